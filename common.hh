@@ -25,6 +25,16 @@
 
 #define FOR(i, m) for(uint32_t i=0; i<(m); ++i)
 
+/* Sizes of the per-event lists in `microspill.spec`, fixed so nothing is allocated per event.
+ * An MVLC stack frame holds at most 2047 words (11-bit `nwords`); a longer readout comes as
+ * any number of continuation frames (0xf580), followed by the last frame (0xf500), each
+ * unpacked into its own list. The user function chains them up to MAX_TIMING_HITS stamps per
+ * readout, and drops (and logs) the frames beyond. Each stamp with the lost-hit marker yields
+ * two time differences. The numbers are spelled out in `mapping.hh` too. */
+#define MAX_FRAME_HITS 2047
+#define MAX_TIMING_HITS 32768
+#define MAX_DT_HITS 65536 // 2 * MAX_TIMING_HITS
+
 #define LEAP_SECONDS 27
 #define TAI_AHEAD_OF_UTC 10
 
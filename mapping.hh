@@ -15,17 +15,17 @@ SIGNAL(ECL_FULL, trloii_mvlc.header.ecl, DATA32);
 SIGNAL(TS_INCREMENT, trloii_mvlc.header.inc_clk, DATA32);
 SIGNAL(ECL_INCREMENT, trloii_mvlc.header.inc_ecl, DATA32);
 
-/* Timing differences. */
-SIGNAL(NO_INDEX_LIST: DELTA_T_1024);
+/* Timing differences, up to MAX_DT_HITS. */
+SIGNAL(NO_INDEX_LIST: DELTA_T_65536);
 SIGNAL(DELTA_T_1, trloii_mvlc.dt, DATA32);
 
 #ifdef DEBUG
-SIGNAL(NO_INDEX_LIST: TRIG_DIFF_1024);
+SIGNAL(NO_INDEX_LIST: TRIG_DIFF_32768);
 SIGNAL(TRIG_DIFF_1, trloii_mvlc.trig_dt, DATA32);
 
-SIGNAL(NO_INDEX_LIST: DTTRIG_SIGN_1024);
+SIGNAL(NO_INDEX_LIST: DTTRIG_SIGN_32768);
 SIGNAL(DTTRIG_SIGN_1, trloii_mvlc.trig_dt_sgn, DATA32);
 
-SIGNAL(NO_INDEX_LIST: RAWTS_1024);
+SIGNAL(NO_INDEX_LIST: RAWTS_2047);
 SIGNAL(RAWTS_1, trloii_mvlc.spill.timing, DATA32);
 #endif
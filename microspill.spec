@@ -77,7 +77,7 @@ MUX_HEADER() {
 }
 
 TRLOII_MULTI_TIMING(stackheader) {
-	MEMBER(DATA32 timing[1024] NO_INDEX_LIST);
+	MEMBER(DATA32 timing[MAX_FRAME_HITS] NO_INDEX_LIST);
 
 	UINT32 mvlc_header NOENCODE {
 		0_10: nwords;
@@ -96,11 +96,11 @@ TRLOII_MULTI_TIMING(stackheader) {
 
 SUBEVENT(multi_timing_trloii) {
 	/* Handled in user function */
-	MEMBER(DATA32 dt[1024] NO_INDEX_LIST);
+	MEMBER(DATA32 dt[MAX_DT_HITS] NO_INDEX_LIST);
 
 #ifdef DEBUG
-	MEMBER(DATA32 trig_dt[1024] NO_INDEX_LIST);
-	MEMBER(DATA32 trig_dt_sgn[1024] NO_INDEX_LIST);
+	MEMBER(DATA32 trig_dt[MAX_TIMING_HITS] NO_INDEX_LIST);
+	MEMBER(DATA32 trig_dt_sgn[MAX_TIMING_HITS] NO_INDEX_LIST);
 #endif
 
 	select optional {
@@ -109,9 +109,10 @@ SUBEVENT(multi_timing_trloii) {
 	
 	header = MUX_HEADER();
 	
-	/* For some reason, this guy appears when the rate is very high ..? */
-	select optional {
-		spill_extra = TRLOII_MULTI_TIMING(stackheader = 0xf580);
+	/* Readouts longer than one MVLC frame: any number of continuation frames in front
+	 * of the last one, one `spill_extra` item each, chained in the user function. */
+	select several {
+		multi spill_extra = TRLOII_MULTI_TIMING(stackheader = 0xf580);
 	}
 
 	spill = TRLOII_MULTI_TIMING(stackheader = 0xf500);
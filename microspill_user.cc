@@ -16,6 +16,9 @@ constexpr double clock_freq = 100'000'000.0;
 
 #define DEFAULT_BINS_MICRO 100
 #define DEFAULT_BIN_MACRO 0.1
+#define DEFAULT_QUALITY_WINDOW 100'000 // In units of 10 ns ==> 1 ms counting windows.
+#define DEFAULT_BASELINE_SPILLS 20
+#define DEFAULT_ALARM_SIGMA 4.0
 
 struct g_config_t {
 	std::string name[4] = {"ECL_IN(1)", "ECL_IN(2)", "ECL_IN(3)", "ECL_IN(4)"};
@@ -26,64 +29,39 @@ struct g_config_t {
 	
 	bool json_dump = false;
 	bool should_send_json = false;
+	bool publish_json = true;
+	bool tcp_json = false;   // Bind the JSON publisher.
+
+	std::string json_file;   // Also write every spill as one JSON line here.
+	bool batch = false;      // Offline reprocessing, see `offline/reprocess.py`.
+	uint64_t batch_from = 0;
+	uint64_t batch_until = UINT64_MAX;
+
+	std::string shm_name;    // Publish the spills to this shared-memory segment, empty = don't.
+	double adaptive_p0 = 0;  // False-positive rate of the adaptive binning, 0 = off.
+	std::string checkpoint_file; // Warm restart state, empty = none.
 
 	int tcp_port = 8888;
+	int control_port = -1; // -1 = no runtime reconfiguration.
+
+	bool publish_quality = false;
+	int quality_port = -1; // -1 = `tcp_port` + 1.
+	double alarm_sigma = DEFAULT_ALARM_SIGMA;
+	uint32_t baseline_spills = DEFAULT_BASELINE_SPILLS;
+	uint32_t quality_window = DEFAULT_QUALITY_WINDOW;
 } g_config;
 
+#include "tcp/logring.hpp"
+
 class MicrospillHist;
 class MacrospillHist;
 
-/* Container to keep the values and increments in a stable way. Plus error notifications.*/
-template<uint32_t N = 32>
-class Scaler {
-	static_assert(N <= 32, "Template parameter for `Scaler` must be <= 32.");
-	static const uint32_t _mask = static_cast<uint32_t>((1ULL << N) - 1);
-	static const int64_t wrap_point = 1LL << (N - 2);
-public:
-	uint32_t prev_data; 
-	uint32_t curr_data; 
-	Scaler() : prev_data(-1), curr_data(0xeeeeeeee) {} 
-	
-	inline void assign(uint32_t fresh) { 
-		prev_data = curr_data; 
-		curr_data = fresh & _mask; 
-	} 
-	uint32_t calc_increment() const noexcept { 
-		if(curr_data >= prev_data) { 
-			return curr_data - prev_data; 
-		} 
-		/* Possible miscounting! */
-		if(prev_data - curr_data < static_cast<uint32_t>(wrap_point)) {
-			printf("Backwards counting in scaler struct. Prev = %u, curr = %u\n", prev_data, curr_data); 
-			return -1; 
-		} 
-		/* Wrap-around. */
-		return (uint32_t)((1ll << N) + (int64_t)curr_data - (int64_t)prev_data); 
-	}
-	inline bool is_in_init() const {
-		return (prev_data == (uint32_t)(-1)) and (curr_data == 0xeeeeeeee);
-	}
-
-	/* `x` and `y` should be at most one wrap-around different. */
-	static int32_t calc_diff(uint32_t x, uint32_t y) noexcept {
-		x &= _mask; y &= _mask;
-
-		int64_t raw_diff = static_cast<int64_t>(x) - static_cast<int64_t>(y);
-		if(raw_diff > wrap_point) { // `y` is one wrap ahead.
-			return static_cast<int32_t>(raw_diff - (1ll<<N));
-		}
-		else if(raw_diff < -wrap_point) { // `x` is one wrap ahead.
-			return static_cast<int32_t>(raw_diff + (1ll<<N));
-		}
-		else {
-			return static_cast<int32_t>(raw_diff);
-		}
-	}
-};
+#define SCALER_WARN LOG_WARN
+#include "tcp/scaler.hpp"
 
 /* Part coming from Whiterabbit. Can be 0's if no module present. */
+uint64_t wr_prev = 0;
 void unpack_wr_increment(unpack_event *event) {
-	static uint64_t wr_prev = 0;
 	DATA32 ts_lo = event->trloii_mvlc.wr_ts.ts_lo;
 	DATA32 ts_hi = event->trloii_mvlc.wr_ts.ts_hi;
 	DATA32* ts_inc = &event->trloii_mvlc.wr_ts.increment;
@@ -122,68 +100,191 @@ void unpack_header(unpack_event *event) {
 
 template<uint32_t N>
 using nil = raw_list_ii_zero_suppress<DATA32, DATA32, N>;
+static_assert(MAX_DT_HITS >= 2 * MAX_TIMING_HITS, "`dt` must hold two items per stamp.");
+#define MAX_CHAINED_FRAMES (MAX_TIMING_HITS / MAX_FRAME_HITS + 1)
 
 Scaler<31> last_ts[4]; 
 
-void unpack_spill_data(unpack_event *event) {
+#include "zmqpp/zmqpp.hpp"
+zmqpp::context *context;
+zmqpp::socket *pub;
+zmqpp::socket *pub_quality;
+
+#include "tcp/microspill.hpp"
+MicrospillHist micro[4];
+MacrospillHist Macro[4];
+struct timespec sys_ts;
+
+#include "tcp/adaptive.hpp"
+#include "tcp/hitbatch.hpp"
+#include "tcp/quality.hpp"
+#include "tcp/fold.hpp"
+#include "tcp/burst.hpp"
+#include "tcp/trend.hpp"
+#include "tcp/shed.hpp"
+#include "tcp/shm_ring.hpp"
+#include "tcp/reconfig.hpp"
+
+enum class FillMode {
+	None,     // Only unwrap the stamps into `dt`.
+	Onspill,  // .. and fill the micro- and macrospill histograms of the channel.
+	Offspill  // .. and count the hits as offspill.
+};
+
+/* Per-event state of the hit kernel. Each hit is unwrapped and histogrammed in one go. */
+struct HitKernel {
+	nil<MAX_DT_HITS>* out_delta_t;
+	Scaler<31>* scaler;
+	MicrospillHist* micro;
+	MacrospillHist* macro;
+	SpillQuality* quality;
+	PhaseFold* fold;
+	BurstStats* burst;
+	uint32_t ch;
+	uint32_t produced = 0;
+
+	template<FillMode mode, bool first_after_bos>
+	inline void emit(uint32_t dt) {
+		out_delta_t->append_item().value = dt;
+		if constexpr (mode == FillMode::Onspill) {
+			if constexpr (first_after_bos) {
+				micro->fill(dt);
+				if(macro->fill_first(dt, produced == 0)) {
+					quality->fill(dt);
+					if(burst->enabled()) burst->fill(dt);
+				}
+			}
+			else {
+				hit_batch.push(ch, dt);
+				quality->fill(dt);
+				if(burst->enabled()) burst->fill(dt);
+			}
+		}
+		++produced;
+	}
+
+	/* Items [from, to) of one timing block. */
+	template<FillMode mode, bool first_after_bos>
+	inline void run(const nil<MAX_FRAME_HITS>* timing, uint32_t from, uint32_t to) {
+		unwrap_stamps(*scaler, [timing](uint32_t i) { return (uint32_t)timing->_items[i].value; }, from, to,
+			[this](uint32_t dt) { emit<mode, first_after_bos>(dt); },
+			[this](uint32_t dt) {
+				/* Only the stamped hit is folded, with its full `dt`. */
+				if constexpr (mode == FillMode::Onspill) {
+					if(fold->enabled()) fold->fill(dt);
+				}
+			});
+	}
+};
+
+/* Unwraps the stamps of the continuation frames and the last frame into `dt`,
+ * filling the histograms of the triggering channel in the same pass according to `mode`.
+ * Returns the number of `dt` items produced. */
+uint32_t unpack_spill_data(unpack_event *event, FillMode mode) {
 	/* Relative to the trigger - the ACCEPT_TRIG[i] is always with a delay
 	 * of ~491 clock cycles, relative to the VULOM clock (31 bits).
 	 * So, this hit needs to be kicked out. */
 
-	nil<1024>* out_delta_t = &event->trloii_mvlc.dt;
-	nil<1024>* timing;
+	/* Chain the continuation frames in front of the last one, up to MAX_TIMING_HITS stamps. */
+	const nil<MAX_FRAME_HITS>* blocks[MAX_CHAINED_FRAMES];
+	uint32_t nblocks = 0, nstamps = 0, ndropped = 0;
+	auto chain = [&](const nil<MAX_FRAME_HITS>* b) {
+		if(ndropped > 0 or nblocks == MAX_CHAINED_FRAMES or nstamps + b->_num_items > MAX_TIMING_HITS) {
+			ndropped += b->_num_items;
+			return;
+		}
+		blocks[nblocks++] = b;
+		nstamps += b->_num_items;
+	};
+	auto& extra = event->trloii_mvlc.spill_extra;
+	for(uint32_t f=0; f < (uint32_t)extra._num_items; ++f) chain(&extra._items[f].timing);
+	chain(&event->trloii_mvlc.spill.timing);
+	if(ndropped > 0) {
+		LOG_WARN("Readout of %u stamps, dropped the last %u beyond %u.\n",
+			nstamps + ndropped, ndropped, MAX_TIMING_HITS);
+	}
 	
-	bool is_trig_included = 0; 
-	bool is_trig_kicked_out = 0;
 	auto ttype = event->trigger; // 1,2,3,4 or 12,13
-	if(ttype == 12 || ttype == 13) {
-		ttype = 1; is_trig_included = 1;
+	bool is_trig_included = (ttype == 12 || ttype == 13);
+	if(is_trig_included) ttype = 1;
+
+	/* Locate the fake hit up front, keeping the per-hit loop free of the check. */
+	int trig_block = -1;
+	uint32_t trig_index = 0;
+	if(is_trig_included) {
+		uint32_t clk_val = (&event->trloii_mvlc.header.clk)->value;
+		for(int b = 0; b < (int)nblocks and trig_block < 0; ++b) {
+			for(uint32_t i=0; i < blocks[b]->_num_items; ++i) {
+				int diff = Scaler<31>::calc_diff(clk_val, blocks[b]->_items[i].value);
+				if(diff > 490 && diff < 512) {
+					/* Fake hit, coming from trigger input. Don't map it to the *scaler object. */
+					trig_block = b; trig_index = i;
+					break;
+				}
+			}
+		}
 	}
 
-	auto* scaler = &last_ts[ttype - 1];
-	
-	bool is_in_init = scaler->is_in_init();
-#define EXPAND \
-	for(uint32_t i=0; i < timing->_num_items; ++i) { \
-		uint32 val = timing->_items[i].value; \
-		if(is_trig_included && !is_trig_kicked_out) { \
-			uint32_t clk_val = (&event->trloii_mvlc.header.clk)->value; \
-			int diff = Scaler<31>::calc_diff(clk_val, val); \
-			if(diff > 490 && diff < 512) { \
-				/* Fake hit, coming from trigger input. Don't map it to the *scaler object. */\
-				is_trig_kicked_out = true; \
-				continue; \
-			} \
-		} \
-		/* 32nd bit is error marker. 
-		 * Means one or more hits between `valid` items got simply lost. 
-		 * This doesn't happen until ~2.5 MHz (in one channel). */\
-		scaler->assign(val); \
-		if(is_in_init) continue; \
-		uint32_t dt = scaler->calc_increment(); \
-		if(val & 0x80000000) { \
-			/* One hit in between has been lost for sure. 
-			 * Try to fake it by supposing it's right in the middle of them. */ \
-			out_delta_t->append_item().value = dt / 2; \
-			out_delta_t->append_item().value = dt / 2; \
-		} \
-		else { /* No hits lost. */ \
-			out_delta_t->append_item().value = dt; \
-		} \
-	}
-
-	/* Try to see if there's a block in front. */
-	timing = &event->trloii_mvlc.spill_extra.timing;
-	EXPAND
-
-	timing = &event->trloii_mvlc.spill.timing;
-	EXPAND
-#undef EXPAND
+	HitKernel k{&event->trloii_mvlc.dt, &last_ts[ttype - 1],
+		&micro[ttype - 1], &Macro[ttype - 1], &quality[ttype - 1], &fold[ttype - 1], &burst[ttype - 1], ttype - 1};
+
+	bool first_after_bos = false;
+	if(mode == FillMode::Onspill and k.macro->is_first_after_bos) {
+		/* Abusing the fact that timing list is sorted in time. */
+		uint32_t b = 0;
+		while(b < nblocks and blocks[b]->_num_items == 0) ++b;
+		if(b < nblocks) {
+			k.macro->start(blocks[b]->_items[0].value);
+			k.fold->start(Scaler<31>::calc_diff(blocks[b]->_items[0].value, k.macro->bos_ts));
+			first_after_bos = true;
+		}
+	}
+
+	if(k.scaler->is_in_init()) {
+		for(int b = 0; b < (int)nblocks; ++b) {
+			for(uint32_t i=0; i < blocks[b]->_num_items; ++i) {
+				if(b == trig_block and i == trig_index) continue;
+				k.scaler->assign(blocks[b]->_items[i].value);
+			}
+		}
+		/* Nothing filled: the next event continues from the last stamp, not from the first. */
+		if(first_after_bos) {
+			k.macro->start(k.scaler->curr_data);
+			k.fold->start(Scaler<31>::calc_diff(k.scaler->curr_data, k.macro->bos_ts), false);
+		}
+		return 0;
+	}
+
+	auto run_all = [&]<FillMode m, bool first>() {
+		for(int b = 0; b < (int)nblocks; ++b) {
+			uint32_t n = blocks[b]->_num_items;
+			if(b == trig_block) {
+				k.run<m, first>(blocks[b], 0, trig_index);
+				k.run<m, first>(blocks[b], trig_index + 1, n);
+			}
+			else k.run<m, first>(blocks[b], 0, n);
+		}
+	};
+
+	switch(mode) {
+	case FillMode::None:
+		run_all.template operator()<FillMode::None, false>();
+		break;
+	case FillMode::Offspill:
+		run_all.template operator()<FillMode::Offspill, false>();
+		k.macro->fill_offspill(k.produced);
+		break;
+	case FillMode::Onspill:
+		if(first_after_bos) run_all.template operator()<FillMode::Onspill, true>();
+		else run_all.template operator()<FillMode::Onspill, false>();
+		break;
+	}
 	
 #ifdef DEBUG
+	nil<MAX_FRAME_HITS>* timing = &event->trloii_mvlc.spill.timing;
 	uint32_t clk_val = (&event->trloii_mvlc.header.clk)->value; 
-	nil<1024>* out_dtrig = &event->trloii_mvlc.trig_dt;
-	nil<1024>* out_dtrig_sgn = &event->trloii_mvlc.trig_dt_sgn;
+	nil<MAX_TIMING_HITS>* out_dtrig = &event->trloii_mvlc.trig_dt;
+	nil<MAX_TIMING_HITS>* out_dtrig_sgn = &event->trloii_mvlc.trig_dt_sgn;
 	for(uint32_t i=0; i < timing->_num_items; ++i) { 	
 		uint32 val = timing->_items[i].value;
 		int diff = Scaler<31>::calc_diff(val, clk_val);
@@ -191,15 +292,16 @@ void unpack_spill_data(unpack_event *event) {
 		out_dtrig_sgn->append_item().value = (val > clk_val) ? 1 : 0;
 	}
 #endif
+	return k.produced;
 }
 
-#include "zmqpp/zmqpp.hpp"
-zmqpp::context *context;
-zmqpp::socket *pub;
-
-#include "tcp/microspill.hpp"
 json jmicro;
 char ts_string[32] = {'\0'};
+std::ofstream json_out;
+
+inline uint64_t wr_of(unpack_event *event) {
+	return ((uint64_t)(event->trloii_mvlc.wr_ts.ts_hi) << 32) | (uint64_t)event->trloii_mvlc.wr_ts.ts_lo;
+}
 
 enum class SpillStatus {
 	Unknown,
@@ -207,51 +309,165 @@ enum class SpillStatus {
 	Offspill
 };
 
+/* State of the spill in progress. */
+uint32_t bos_ts = 0;
+uint32_t eos_ts = 0;
+uint32_t spill_number = 0;
+uint64_t bos_wr = 0;
+SpillStatus spill_status = SpillStatus::Unknown;
+
+/* Push the binning, range and names of `g_config` to the histograms.
+ * Called at init, and at BoS when a runtime change is pending. */
+void apply_config() {
+	FOR(i,4) {
+		micro[i].name = g_config.name[i];
+		micro[i].set_bins(g_config.nbins_micro[i]);
+		micro[i].set_range(g_config.max_range_micro[i] > 100 ?
+			g_config.max_range_micro[i] : MAX_RANGE_MICRO_DEFAULT);
+		Macro[i].bin_width = g_config.acc_period_macro[i];
+		micro[i].enable_fine(g_config.adaptive_p0 > 0);
+	}
+}
+
+#include "tcp/checkpoint.hpp"
+
+/* Publish the spill-quality statistics on the "stats" topic, and an alarm on the
+ * "alarm" topic if any channel degraded with respect to its baseline.
+ * Called first thing at EoS, before the (slower) JSON conversion of the histograms. */
+void publish_quality(uint32_t spill_number, const QualityMetrics (&qm)[4]) {
+	json jstats, jalarm;
+	json alarms = json::array();
+	jstats["data"] = json::array();
+	FOR(i,4) {
+		baseline[i].check(qm[i], g_config.alarm_sigma, i, micro[i].name, alarms);
+		baseline[i].push(qm[i]);
+		jstats["data"].push_back(quality_to_json(qm[i], micro[i].name));
+	}
+	if(!alarms.empty()) {
+		jalarm["spill_number"] = spill_number;
+		jalarm["timestamp"] = ts_string;
+		jalarm["alarms"] = std::move(alarms);
+		zmqpp::message msg;
+		msg << "alarm" << jalarm.dump();
+		pub_quality->send(msg, true);
+	}
+	jstats["spill_number"] = spill_number;
+	jstats["timestamp"] = ts_string;
+	jstats["log"] = logring.take_recent();
+	zmqpp::message msg;
+	msg << "stats" << jstats.dump();
+	pub_quality->send(msg, true);
+}
+
+static_assert(SHM_MAX_BINS_MICRO == MAX_BINS_MICRO and SHM_MAX_BINS_MACRO == MAX_BINS_MACRO);
+ShmWriter shm;
+
+/* Copy the raw histograms into the next record of the shared-memory ring. */
+void publish_shm(uint32_t spill_number, uint64_t ts, uint64_t bos_wr, int32_t spill_duration, const QualityMetrics (&qm)[4]) {
+	ShmSpill& r = shm.begin();
+	r.spill_number = spill_number;
+	r.timestamp_ns = ts;
+	r.bos_wr_ns = bos_wr;
+	r.spill_duration = spill_duration;
+	FOR(i,4) {
+		const MicrospillHist& h = micro[i];
+		const MacrospillHist& m = Macro[i];
+		ShmChannel& c = r.ch[i];
+		strncpy(c.name, h.name.c_str(), SHM_NAME_LEN - 1);
+		c.name[SHM_NAME_LEN - 1] = '\0';
+		c.counted = h.hits_counted;
+		c.lost_hits = abs(h.hits_counted - Scaler<>::calc_diff(h.ecl_end, h.ecl_start));
+		c.overflows = h.overflows;
+		c.offspill = m.offspill;
+		c.macro_errors = m.get_errors();
+		c.elapsed_time_10ns = Scaler<>::calc_diff(h.end_ts, h.start_ts);
+
+		c.nbins_micro = h.nbins;
+		c.max_range_micro = h.get_range();
+		memcpy(c.micro, h.arr, h.nbins * sizeof(uint32_t));
+
+		c.bin_macro = m.bin_width;
+		int last_bin = std::clamp(static_cast<int>(spill_duration / 1e8 / m.bin_width), 0, MAX_BINS_MACRO - 1);
+		c.nbins_macro = last_bin + 1;
+		memcpy(c.macro, m.arr, c.nbins_macro * sizeof(uint32_t));
+
+		c.duty_factor = qm[i].duty_factor;
+		c.fano_factor = qm[i].fano_factor;
+		c.cv_dt = qm[i].cv_dt;
+		c.peak_to_mean = qm[i].peak_to_mean;
+		c.lost_fraction = qm[i].lost_fraction;
+	}
+	shm.commit();
+}
+
+void exit_user_function();
+
 int unpack_user_function(unpack_event *event) {
+	if(checkpoint.is_open()) checkpoint.restore(event);
 	unpack_wr_increment(event);
 	unpack_header(event);
-	unpack_spill_data(event);
-
-	static uint32_t bos_ts = 0;
-	static uint32_t eos_ts = 0;
-	static uint32_t spill_number = 0;
+	if(shed.enabled()) shed.observe(event->trloii_mvlc.header.clk.value);
 
-	static SpillStatus spill_status = SpillStatus::Unknown;
 	auto ttype = event->trigger; /* 1,2,3,4 ; 12,13 */
 
-	if(!g_config.should_send_json) goto return_placeholder;
+	if(!g_config.should_send_json) {
+		unpack_spill_data(event, FillMode::None);
+		goto return_placeholder;
+	}
 	
 	if(ttype == 12) { // BoS
+		hit_batch.clear(); // Left over if the last EoS was missed, that spill is dropped anyway.
+		if(control.pending()) {
+			control.take(g_config);
+			apply_config();
+		}
+		bos_wr = wr_of(event);
+		if(g_config.batch) {
+			if(bos_wr == 0) {
+				YELL("Batch mode needs Whiterabbit timestamps to assign spills to files. Aborting.\n"); exit(1);
+			}
+			/* This spill belongs to the worker of the next file, and so does the rest of the input. */
+			if(bos_wr >= g_config.batch_until) {
+				json_out.close();
+				exit_user_function();
+				exit(0);
+			}
+		}
 		bos_ts = vulom_time[0].curr_data;
 		FOR(i,4) Macro[i].bos_ts = bos_ts;	
 		
-		FOR(i,4) { micro[i].reset(); Macro[i].init(); }
+		if(shed.enabled()) {
+			if(shed.begin_spill()) {
+				LOG_WARN("Processing lag %.2f s, prescaling the hits by %u, %u, %u, %u.\n", shed.lag,
+					shed.prescale[0], shed.prescale[1], shed.prescale[2], shed.prescale[3]);
+			}
+			FOR(i,4) { micro[i].set_prescale(shed.prescale[i]); fold[i].set_prescale(shed.prescale[i]); }
+		}
+		FOR(i,4) { micro[i].reset(); Macro[i].init(); quality[i].reset(); fold[i].reset(); burst[i].reset(); }
 
-		auto r = micro[0].fill(event);
+		auto r = unpack_spill_data(event, FillMode::Onspill);
 		if(r > 0) {
 			micro[0].ecl_start = ecl_in[0].curr_data;
 			micro[0].start_ts = vulom_time[0].curr_data;
 		}
-		Macro[0].fill(event);
 		spill_status = SpillStatus::Onspill;
 	}
 
 	else if(ttype == 13) { // EoS
 		eos_ts = vulom_time[0].curr_data;
 		FOR(i,4) Macro[i].eos_ts = eos_ts;	
-		auto r = micro[0].fill(event);	
+		auto r = unpack_spill_data(event, FillMode::Onspill);
 		if(r > 0) {
 			micro[0].ecl_end = ecl_in[0].curr_data;
 			micro[0].end_ts = vulom_time[0].curr_data;
 		}
-		Macro[0].fill(event);
 		/* Extract timestamp. */
 		uint64_t ts = 0;
 		if(event->trloii_mvlc.wr_ts.ts_hi == 0) {
 			if(clock_gettime(CLOCK_REALTIME, &sys_ts) == 0) {
 				ts = sys_ts.tv_nsec + (uint64_t)sys_ts.tv_sec * 1000000000ULL;
 			} else {
-				WARN("Error "); perror("clock_gettime");
+				LOG_WARN("Error clock_gettime: %s\n", strerror(errno));
 			}
 		}
 		else {
@@ -261,11 +477,22 @@ int unpack_user_function(unpack_event *event) {
 		}
 		timestamp_to_string(ts, ts_string);
 			
+		hit_batch.flush_all();
+
 		/* If the spill is not fully sampled, don't histogram the data.
 		 * Initially unpacker can start catching packets within ongoing spill, 
 		 * catching an EoS without first catching BoS. */
 		
 		if(spill_status != SpillStatus::Unknown) {
+			++spill_number;
+			if(shed.enabled()) FOR(i,4) {
+				micro[i].scale_up();
+				shed.end_spill(i, micro[i].hits_counted + micro[i].overflows);
+			}
+			QualityMetrics qm[4];
+			FOR(i,4) qm[i] = compute_quality(quality[i], micro[i], Macro[i]);
+			if(g_config.publish_quality) publish_quality(spill_number, qm);
+
 			/* Convert to JSON. */
 			std::vector<std::future<json>> json_future;
 			FOR(i,4) {
@@ -275,9 +502,21 @@ int unpack_user_function(unpack_event *event) {
 			FOR(i,4) {
 				jmicro["data"][i] = std::move(json_future[i].get());
 			}
-			jmicro["spill_number"] = ++spill_number;
+			if(fold_config.ncand > 0) FOR(i,4) jmicro["data"][i]["fold"] = fold[i].to_json();
+			if(burst[0].enabled()) FOR(i,4) {
+				burst[i].finish();
+				jmicro["data"][i]["burst"] = burst[i].to_json();
+			}
+			if(g_config.adaptive_p0 > 0) FOR(i,4) jmicro["data"][i]["adaptive"] = adaptive_to_json(micro[i], g_config.adaptive_p0);
+			if(shed.enabled()) {
+				FOR(i,4) jmicro["data"][i]["prescale"] = micro[i].prescale;
+				jmicro["lag"] = shed.lag;
+			}
+			jmicro["spill_number"] = spill_number;
 			jmicro["spill_duration"] = Scaler<>::calc_diff(eos_ts, bos_ts);
 			jmicro["timestamp"] = ts_string;
+			trend.push(ts, jmicro["spill_duration"], jmicro["data"], qm);
+			if(shm.is_open()) publish_shm(spill_number, ts, bos_wr, jmicro["spill_duration"], qm);
 			
 			if(g_config.json_dump) {
 				const char* fileName = "tcp/example.json";
@@ -289,11 +528,19 @@ int unpack_user_function(unpack_event *event) {
 				exit(0);
 			}
 
+			if(json_out.is_open() and (!g_config.batch or bos_wr >= g_config.batch_from)) {
+				jmicro["bos_wr_ns"] = bos_wr;
+				json_out << jmicro.dump() << '\n';
+				json_out.flush();
+			}
+
 			/* Send over TCP */
-			std::string message = jmicro.dump();
-			
-			/* This call can block at most UCESB_TCP_SERVER_TIMEOUT ms. */
-			pub->send(message);
+			if(g_config.publish_json and pub) {
+				std::string message = jmicro.dump();
+				
+				/* This call can block at most UCESB_TCP_SERVER_TIMEOUT ms. */
+				pub->send(message);
+			}
 		}
 		FOR(i,4) Macro[i].reset();
 		spill_status = SpillStatus::Offspill;
@@ -305,7 +552,7 @@ int unpack_user_function(unpack_event *event) {
 		}
 		int i = ttype - 1;
 		if(spill_status == SpillStatus::Onspill) {
-			micro[i].fill(event);
+			unpack_spill_data(event, FillMode::Onspill);
 			
 			// Assign initial ECL_IN(x) status.
 			if(micro[i].ecl_start == 0) {
@@ -315,15 +562,17 @@ int unpack_user_function(unpack_event *event) {
 			// Assign `potential` final ECL_IN(x) status.
 			micro[i].ecl_end = ecl_in[i].curr_data;
 			micro[i].end_ts = vulom_time[i].curr_data;
-
-			Macro[i].fill(event);
 		}
 		else if(spill_status == SpillStatus::Offspill) {
-			Macro[i].fill_offspill(event);
+			unpack_spill_data(event, FillMode::Offspill);
+		}
+		else {
+			unpack_spill_data(event, FillMode::None);
 		}
 	}
 
 return_placeholder:
+	if(checkpoint.is_open()) checkpoint.maybe_write(event, event->trigger == 12 or event->trigger == 13);
 	return 1;
 }
 
@@ -335,6 +584,7 @@ bool handle_command_line_option(const char *arg) {
 		WARN(KBH_RED "Will sample only one spill, then quit the program!\n\n" KNRM);
 		g_config.json_dump = true;
 		g_config.should_send_json = true;
+		g_config.tcp_json = true;
 		return true;
 	}
 	const char* post;
@@ -354,15 +604,202 @@ bool handle_command_line_option(const char *arg) {
 			WARN("Parsed sending JSON, on port: " BOLD "%d\n" KNRM, g_config.tcp_port); 	
 			g_config.tcp_port = v;
 			g_config.should_send_json = true;
+			g_config.tcp_json = true;
 			return true;
 		}
 	}
 	if(MATCH_ARG("--json")) {
 		WARN("Parsed sending JSON, on port: " BOLD "%d\n" KNRM, g_config.tcp_port); 	
 		g_config.should_send_json = true;
+		g_config.tcp_json = true;
+		return true;
+	}
+	if(MATCH_PREFIX("--json_file=", post)) {
+		g_config.json_file = post;
+		g_config.should_send_json = true;
+		return true;
+	}
+	if(MATCH_ARG("--shm")) {
+		g_config.shm_name = SHM_DEFAULT_NAME;
+		g_config.should_send_json = true;
+		return true;
+	}
+	if(MATCH_PREFIX("--shm=", post)) {
+		if(post[0] != '/' or strchr(post + 1, '/') or strlen(post) > 250) {
+			YELL(EMPH(--shm) " name must be like /name, without further slashes.\n");
+			return false;
+		}
+		g_config.shm_name = post;
+		g_config.should_send_json = true;
+		return true;
+	}
+	if(MATCH_ARG("--batch")) {
+		g_config.batch = true;
 		return true;
 	}
+	if(MATCH_PREFIX("--batch,", post)) {
+		std::regex re(R"(^(from=(\d+))?,?(until=(\d+))?$)");
+		std::cmatch m;
+		if(std::regex_match(post, m, re) and (m[1].matched or m[3].matched)) {
+			try {
+				if(m[1].matched) g_config.batch_from = std::stoull(m[2].str());
+				if(m[3].matched) g_config.batch_until = std::stoull(m[4].str());
+			}
+			catch(std::exception& e) {
+				YELL("Cannot parse " EMPH(--batch) " timestamps: %s\n", e.what());
+				return false;
+			}
+			g_config.batch = true;
+			return true;
+		}
+	}
 	
+	if(MATCH_ARG("--alarm")) {
+		g_config.publish_quality = true;
+		g_config.should_send_json = true; // The spills must be processed, even without a JSON output.
+		return true;
+	}
+	if(MATCH_PREFIX("--alarm,", post)) {
+		std::regex re(R"(^port=([1-9]\d*)$)");
+		std::cmatch m;
+		if(std::regex_match(post, m, re)) {
+			int v = std::atoi(m[1].str().c_str());
+			if(v < 1024 || v >= (1<<16)) {
+				YELL("Alarm port isn't in [1024, 65535] interval.\n");
+				return false;
+			}
+			g_config.quality_port = v;
+			g_config.publish_quality = true;
+			g_config.should_send_json = true;
+			WARN("Parsed publishing spill-quality alarms, on port: " BOLD "%d\n" KNRM, v);
+			return true;
+		}
+	}
+	if(MATCH_PREFIX("--alarm_sigma=", post)) {
+		char* end;
+		double val = strtod(post, &end);
+		if(*end != '\0' or val <= 0) { YELL("Cannot parse " EMPH(--alarm_sigma) ": %s\n", post); return false; }
+		g_config.alarm_sigma = val;
+		return true;
+	}
+	if(MATCH_PREFIX("--alarm_spills=", post)) {
+		int val = std::atoi(post);
+		if(val < MIN_BASELINE_SPILLS or val > MAX_BASELINE_SPILLS) {
+			YELL(EMPH(--alarm_spills) " must be in [%d, %d].\n", MIN_BASELINE_SPILLS, MAX_BASELINE_SPILLS);
+			return false;
+		}
+		g_config.baseline_spills = val;
+		return true;
+	}
+	if(MATCH_PREFIX("--quality_window=", post)) {
+		char* end;
+		double val = strtod(post, &end);
+		if(*end != '\0' or val < 1e-6 or val > 1.0) { YELL(EMPH(--quality_window) " must be in [1e-6, 1] seconds.\n"); return false; }
+		g_config.quality_window = static_cast<uint32_t>(val * clock_freq);
+		return true;
+	}
+
+	if(MATCH_PREFIX("--checkpoint=", post)) {
+		g_config.checkpoint_file = post;
+		return true;
+	}
+	if(MATCH_PREFIX("--checkpoint_period=", post)) {
+		char* end;
+		double val = strtod(post, &end);
+		if(*end != '\0' or val < 0.01 or val > CHECKPOINT_MAX_AGE / 2) {
+			YELL(EMPH(--checkpoint_period) " must be in [0.01, %.0f] seconds.\n", CHECKPOINT_MAX_AGE / 2);
+			return false;
+		}
+		checkpoint.period = val;
+		return true;
+	}
+	if(MATCH_PREFIX("--burst=", post)) {
+		std::regex re(R"(^([1-9]\d*)(,min=([1-9]\d*))?$)");
+		std::cmatch m;
+		if(!std::regex_match(post, m, re)) {
+			YELL("Cannot parse " EMPH(--burst) ": %s\n", post);
+			return false;
+		}
+		uint64_t gap = std::stoull(m[1].str());
+		uint32_t min_hits = m[3].matched ? std::stoul(m[3].str()) : DEFAULT_BURST_MIN_HITS;
+		if(gap >= 0x80000000 or min_hits < 2) {
+			YELL(EMPH(--burst) ": gap must be below 2^31 x 10 ns, min at least 2 hits.\n");
+			return false;
+		}
+		FOR(i,4) { burst[i].gap = gap; burst[i].min_hits = min_hits; }
+		return true;
+	}
+	if(MATCH_ARG("--shed")) {
+		shed.lag_budget = DEFAULT_SHED_LAG;
+		return true;
+	}
+	if(MATCH_PREFIX("--shed=", post)) {
+		char* end;
+		double val = strtod(post, &end);
+		if(*end != '\0' or val < 0.01 or val > 3600) { YELL(EMPH(--shed) " lag must be in [0.01, 3600] seconds.\n"); return false; }
+		shed.lag_budget = val;
+		return true;
+	}
+	if(MATCH_ARG("--adaptive")) {
+		g_config.adaptive_p0 = DEFAULT_ADAPTIVE_P0;
+		return true;
+	}
+	if(MATCH_PREFIX("--adaptive=", post)) {
+		char* end;
+		double val = strtod(post, &end);
+		if(*end != '\0' or val <= 0 or val >= 1) { YELL(EMPH(--adaptive) " false-positive rate must be in (0, 1).\n"); return false; }
+		g_config.adaptive_p0 = val;
+		return true;
+	}
+	if(MATCH_PREFIX("--fold=", post)) {
+		std::regex re(R"(^([0-9.eE+]+)(,(scan|n|bins)=[0-9.eE+]+)*$)");
+		std::cmatch m;
+		FoldConfig c;
+		c.ncand = 1;
+		if(!std::regex_match(post, m, re)) {
+			YELL("Cannot parse " EMPH(--fold) ": %s\n", post);
+			return false;
+		}
+		/* Parse the optional fields in any order. */
+		c.period_ns = atof(m[1].str().c_str());
+		std::string rest = post + m[1].length();
+		std::regex field(R"(,(scan|n|bins)=([0-9.eE+]+))");
+		for(auto it = std::sregex_iterator(rest.begin(), rest.end(), field); it != std::sregex_iterator(); ++it) {
+			std::string key = (*it)[1];
+			double v = atof((*it)[2].str().c_str());
+			if(key == "scan") c.scan_ns = v;
+			else if(key == "n") c.ncand = static_cast<uint32_t>(v);
+			else c.nbins = static_cast<uint32_t>(v);
+		}
+		if(c.ncand < 1 or (c.ncand > 1 and c.scan_ns <= 0) or c.scan_ns >= c.period_ns or !fold[0].configure(c)) {
+			YELL(EMPH(--fold) ": needs period > 10 ns x bins / 256, below ~167 ms; n <= %d candidates with scan > 0; bins in [2, %d].\n",
+				FOLD_MAX_CANDIDATES, FOLD_MAX_BINS);
+			return false;
+		}
+		FOR(i,4) fold[i].configure(c);
+		fold_config = c;
+		WARN("Parsed " EMPH(--fold) BOLD ": %.3f ns" KNRM ", %u candidate(s), %u phase bins.\n", c.period_ns, c.ncand, c.nbins);
+		return true;
+	}
+
+	if(MATCH_ARG("--control")) {
+		g_config.control_port = 0;
+		return true;
+	}
+	if(MATCH_PREFIX("--control,", post)) {
+		std::regex re(R"(^port=([1-9]\d*)$)");
+		std::cmatch m;
+		if(std::regex_match(post, m, re)) {
+			int v = std::atoi(m[1].str().c_str());
+			if(v < 1024 || v >= (1<<16)) {
+				YELL("Control port isn't in [1024, 65535] interval.\n");
+				return false;
+			}
+			g_config.control_port = v;
+			return true;
+		}
+	}
+
 	if(MATCH_PREFIX("--nbins_micro", post)) {
 		std::regex re(R"(^(_[1-4])?=([1-9]\d*)$)");
 		std::cmatch m;
@@ -431,6 +868,13 @@ void usage_command_line_options() {
 		   "Dump the example JSON of micro- and macrospill data format for one spill, and then terminate the program.\n");
 	printf(BOLD "  --json[,port=N]     " KNRM
 		   "Send the spill histogramm'ed data in JSON format over port number N. Default port number is 8888.\n");
+	printf(BOLD "  --json_file=PATH   " KNRM
+		   "Write every spill as one line of JSON to PATH (with its BoS Whiterabbit time, `bos_wr_ns`). Doesn't need --json.\n");
+	printf(BOLD "  --shm[=/NAME]      " KNRM
+		   "Publish the spills into a shared-memory ring (default " SHM_DEFAULT_NAME "), for consumers on this host. See " EMPH(tcp/shm_ring.hpp) ".\n");
+	printf(BOLD "  --batch[,from=T][,until=T] " KNRM
+		   "Offline reprocessing: only write spills with BoS Whiterabbit time in [from, until) to " EMPH(--json_file) ", stop at the first BoS past `until`.\n"
+		   "                     Driven by " EMPH(offline/reprocess.py) ".\n");
 	printf(BOLD "  --nbins_micro=N    " KNRM
 			"Bin all four channels of microspill data in N bins. Default %d.\n", DEFAULT_BINS_MICRO);
 	printf(BOLD "  --nbins_micro_i=N  " KNRM
@@ -441,36 +885,84 @@ void usage_command_line_options() {
 			"Bin the macrospill data from " BOLD "i" KNRM "th channel in bin-widths of N seconds (decimal). Default %.1fs.\n", DEFAULT_BIN_MACRO);
 	printf(BOLD "  --alias_i=name     " KNRM
 		   "Alias the channel ECL_IN(i) to a new name `name`, where i=1,2,3 or 4. Quote the \"name\" if you use whitespaces.\n");
+	printf(BOLD "  --checkpoint=PATH  " KNRM
+		   "Keep the unpacker state in PATH, and continue from it after a restart within %.0f s in the same DAQ run.\n", CHECKPOINT_MAX_AGE);
+	printf(BOLD "  --checkpoint_period=T " KNRM
+		   "Seconds between the checkpoints within a spill, default %.1f. Always at BoS and EoS.\n", DEFAULT_CHECKPOINT_PERIOD);
+	printf(BOLD "  --burst=G[,min=N]  " KNRM
+		   "Segment each channel into bursts of >= N hits (default %d) closer than G x 10 ns, published as `burst` per channel.\n",
+		   DEFAULT_BURST_MIN_HITS);
+	printf(BOLD "  --shed[=T]         " KNRM
+		   "When processing lags more than T seconds (default %.1f) behind the readout, histogram only every k-th hit\n"
+		   "                     of the busy channels, scaled back by k. Published as `prescale` per channel and `lag`.\n", DEFAULT_SHED_LAG);
+	printf(BOLD "  --adaptive[=P0]    " KNRM
+		   "Also publish the microspill spectrum in adaptive (Bayesian-blocks style) bins, as `adaptive`. P0 is the false-positive rate, default %.2f.\n",
+		   DEFAULT_ADAPTIVE_P0);
+	printf(BOLD "  --fold=P[,scan=S,n=N][,bins=B] " KNRM
+		   "Histogram the hit times since BoS modulo period P [ns] (B phase bins, default %d), published as `fold` per channel.\n"
+		   "                     With N candidate periods in [P-S, P+S], the one with the most structured phase histogram is published.\n",
+		   FOLD_DEFAULT_BINS);
+	printf(BOLD "  --control[,port=N] " KNRM
+		   "Accept runtime changes of binning, range, aliases and publishing on a ZMQ REP socket on port N, applied at the next BoS. Default: JSON port + 2.\n");
+	printf(BOLD "  --alarm[,port=N]   " KNRM
+		   "Publish spill-quality statistics (topic \"stats\") and alarms (topic \"alarm\") at EoS, on port N. Default: JSON port + 1.\n");
+	printf(BOLD "  --alarm_sigma=X    " KNRM
+		   "Raise an alarm when a quality metric degrades by more than X sigma from its baseline. Default %.1f.\n", DEFAULT_ALARM_SIGMA);
+	printf(BOLD "  --alarm_spills=N   " KNRM
+		   "Number of previous spills forming the baseline. Default %d.\n", DEFAULT_BASELINE_SPILLS);
+	printf(BOLD "  --quality_window=T " KNRM
+		   "Counting window in seconds for the duty and Fano factors. Default %.3fs.\n", DEFAULT_QUALITY_WINDOW / clock_freq);
 }
 
 void init_user_function() {
+	if(g_config.control_port >= 0 and !g_config.should_send_json) {
+		YELL("\nError: " EMPH(--control) " changes the spill outputs, but none is given (--json, --json_file, --shm or --alarm) .. Exiting.\n\n");
+		exit(2);
+	}
+	if(g_config.batch and g_config.json_file.empty()) {
+		YELL("\nError: " EMPH(--batch) " writes its spills with " EMPH(--json_file) ", which isn't given .. Exiting.\n\n");
+		exit(2);
+	}
+	logring.start(g_config.publish_quality);
 	if(g_config.should_send_json) {
 		context = new zmqpp::context;
-		pub = new zmqpp::socket(*context, zmqpp::socket_type::publish);
 		char _s[64] = {'\0'};
-		sprintf(_s, "tcp://*:%d", g_config.tcp_port);
-		try {
-			pub->bind(_s);
-			WARN("Successfully bound JSON server to TCP port: " EMPH(%d) ".\n", g_config.tcp_port);
-		}
-		catch(std::exception& e) {
-			YELL("\nError: Unable to bind to TCP port: %d .. Exiting.\n\n", g_config.tcp_port);
-			WARN(" .. was executing pub->bind(\"%s\")\n", _s);
+		if(g_config.tcp_json) {
+			pub = new zmqpp::socket(*context, zmqpp::socket_type::publish);
+			sprintf(_s, "tcp://*:%d", g_config.tcp_port);
+			try {
+				pub->bind(_s);
+				WARN("Successfully bound JSON server to TCP port: " EMPH(%d) ".\n", g_config.tcp_port);
+			}
+			catch(std::exception& e) {
+				YELL("\nError: Unable to bind to TCP port: %d .. Exiting.\n\n", g_config.tcp_port);
+				WARN(" .. was executing pub->bind(\"%s\")\n", _s);
 
-			if(pub && pub->operator bool()) pub->close();
-			exit(2);
-		}
-		/* Put a small timeout (in milliseconds), how long a send call
-		 * can block the main thread. */
+				if(pub && pub->operator bool()) pub->close();
+				exit(2);
+			}
+			/* Put a small timeout (in milliseconds), how long a send call
+			 * can block the main thread. */
 #define UCESB_TCP_SERVER_TIMEOUT 30
-		pub->set(zmqpp::socket_option::send_timeout, UCESB_TCP_SERVER_TIMEOUT);
-
-		FOR(i,4) {
-			micro[i].name = g_config.name[i];
-			micro[i].set_bins(g_config.nbins_micro[i]);
-			if(g_config.max_range_micro[i] > 100)
-				micro[i].set_range(g_config.max_range_micro[i]);
+			pub->set(zmqpp::socket_option::send_timeout, UCESB_TCP_SERVER_TIMEOUT);
 		}
+		if(!g_config.shm_name.empty()) {
+			if(!shm.open(g_config.shm_name)) {
+				YELL("\nError: Unable to create shared memory %s: %s .. Exiting.\n\n", g_config.shm_name.c_str(), strerror(errno));
+				exit(2);
+			}
+			WARN("Publishing spills to shared memory: " EMPH(%s) ".\n", g_config.shm_name.c_str());
+		}
+		if(!g_config.json_file.empty()) {
+			json_out.open(g_config.json_file, std::ios::out | std::ios::trunc);
+			if(!json_out) {
+				YELL("\nError: Unable to open %s for writing .. Exiting.\n\n", g_config.json_file.c_str());
+				exit(2);
+			}
+			WARN("Writing spills as JSON lines to: " EMPH(%s) ".\n", g_config.json_file.c_str());
+		}
+
+		apply_config();
 		
 		jmicro["data"] = json::array({
 			json::object(),
@@ -479,14 +971,47 @@ void init_user_function() {
 			json::object()
 		});
 
-		FOR(i,4) {
-			Macro[i].bin_width = g_config.acc_period_macro[i];
+		if(g_config.publish_quality) {
+			int port = (g_config.quality_port > 0) ? g_config.quality_port : g_config.tcp_port + 1;
+			pub_quality = new zmqpp::socket(*context, zmqpp::socket_type::publish);
+			sprintf(_s, "tcp://*:%d", port);
+			try {
+				pub_quality->bind(_s);
+				WARN("Successfully bound spill-quality server to TCP port: " EMPH(%d) ".\n", port);
+			}
+			catch(std::exception& e) {
+				YELL("\nError: Unable to bind to TCP port: %d .. Exiting.\n\n", port);
+				exit(2);
+			}
+			FOR(i,4) {
+				quality[i].window = g_config.quality_window;
+				quality[i].reset();
+				baseline[i].nspills = g_config.baseline_spills;
+			}
+		}
+
+		if(g_config.control_port >= 0) {
+			int port = (g_config.control_port > 0) ? g_config.control_port : g_config.tcp_port + 2;
+			control.start(context, port, g_config);
+		}
+	}
+
+	/* Also without any output, the scalers keep the `dt` of the ucesb output continuous. */
+	if(!g_config.checkpoint_file.empty()) {
+		if(!checkpoint.open(g_config.checkpoint_file.c_str())) {
+			YELL("\nError: Unable to open checkpoint %s: %s .. Exiting.\n\n", g_config.checkpoint_file.c_str(), strerror(errno));
+			exit(2);
 		}
 	}
 } 
 
 void exit_user_function() {
+	control.stop();
+	logring.stop();
+	shm.close();
+	checkpoint.close();
 	if(pub && pub->operator bool()) pub->close();
+	if(pub_quality && pub_quality->operator bool()) pub_quality->close();
 	if(context && context->operator bool()) context->terminate();
 	
 	if(g_config.should_send_json) {
@@ -0,0 +1,100 @@
+#!/usr/bin/python3
+import sys
+
+usage = f'''Usage: {sys.argv[0]} [-j N] [-o OUT] [--exe PATH] FILE.lmd ... [-- UNPACKER_OPTIONS]
+Reprocess LMD files in parallel, one unpacker per file, and merge the spills into
+one JSON-lines file (default: stdout), ordered by their BoS Whiterabbit time.
+Each worker starts at its file and reads on into the following ones to finish the spill
+that straddles the file boundary; spills are assigned to the file their BoS is in.
+  -j N        number of parallel workers, default: number of cores
+  -o OUT      output file
+  --exe PATH  unpacker executable, default: ./microspill
+Options after -- are passed to every worker, e.g. -- --nbins_micro=120 --alias_2=SCI21'''
+
+if len(sys.argv) < 2 or '--help' in sys.argv:
+    print(usage)
+    quit()
+
+import os
+import re
+import json
+import heapq
+import tempfile
+import subprocess
+from concurrent.futures import ThreadPoolExecutor
+
+args = sys.argv[1:]
+extra = []
+if '--' in args:
+    extra = args[args.index('--') + 1:]
+    args = args[:args.index('--')]
+
+jobs = os.cpu_count()
+out_path = None
+exe = './microspill'
+files = []
+it = iter(args)
+for a in it:
+    if a == '-j': jobs = int(next(it))
+    elif a == '-o': out_path = next(it)
+    elif a == '--exe': exe = next(it)
+    else: files.append(a)
+
+# Whiterabbit block: id word, then four words with the 0x03e1 .. 0x06e1 markers, see microspill.spec.
+wr_pattern = re.compile(rb'..\xe1\x03..\xe1\x04..\xe1\x05..\xe1\x06', re.DOTALL)
+
+def first_wr(path, nbytes=1 << 22):
+    with open(path, 'rb') as f:
+        data = f.read(nbytes)
+    for m in wr_pattern.finditer(data):
+        if m.start() % 4: continue
+        w = [int.from_bytes(data[m.start() + 4*i:m.start() + 4*i + 2], 'little') for i in range(4)]
+        return w[0] | (w[1] << 16) | (w[2] << 32) | (w[3] << 48)
+    return None
+
+starts = [first_wr(f) for f in files]
+if None in starts:
+    missing = [f for f, s in zip(files, starts) if s is None]
+    print(f"No Whiterabbit timestamps found in: {' '.join(missing)}\n"
+          f"Can't split the spills between files, run the unpacker on all files sequentially instead.")
+    quit(1)
+files, starts = zip(*sorted(zip(files, starts), key=lambda p: p[1]))
+
+tmpdir = tempfile.mkdtemp(prefix='reprocess_')
+
+def work(k):
+    out = os.path.join(tmpdir, f'{k}.jsonl')
+    batch = f'--batch,from={starts[k]}'
+    if k + 1 < len(files):
+        batch += f',until={starts[k + 1]}'
+    cmd = [exe, *files[k:], f'--json_file={out}', batch, *extra]
+    r = subprocess.run(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    if r.returncode != 0:
+        raise RuntimeError(f"{' '.join(cmd)} failed ({r.returncode}):\n{r.stderr[-2000:]}")
+    return out
+
+with ThreadPoolExecutor(max_workers=jobs) as pool:
+    outputs = list(pool.map(work, range(len(files))))
+
+def spills(path):
+    with open(path) as f:
+        for line in f:
+            j = json.loads(line)
+            yield j['bos_wr_ns'], line, j
+
+out = open(out_path, 'w') if out_path else sys.stdout
+n = 0
+last = None
+for bos, line, j in heapq.merge(*(spills(p) for p in outputs), key=lambda s: s[0]):
+    if bos == last: continue  # Same spill seen by two workers.
+    last = bos
+    n += 1
+    j['spill_number'] = n
+    out.write(json.dumps(j) + '\n')
+if out_path:
+    out.close()
+    print(f"Merged {n} spills from {len(files)} files into {out_path}")
+
+for p in outputs:
+    os.remove(p)
+os.rmdir(tmpdir)
@@ -0,0 +1,539 @@
+/* Synthetic data source for `microspill`, for load testing without beam.
+ *
+ * Emits LMD events shaped like the ones `microspill.spec` unpacks: optional
+ * Whiterabbit block, `MUX_HEADER` (0xbeefbabe barrier, TPAT, ECL scaler, VULOM clock)
+ * and `TRLOII_MULTI_TIMING` blocks with stack headers 0xf580 / 0xf500.
+ * Events are either written to an LMD file, or served over a minimal MBS stream
+ * server stand-in, so the unpacker can be attached as `./microspill --stream=localhost`.
+ *
+ * Timing model: hits are Poisson per channel, with on-spill rate modulated by a
+ * sinusoidal ripple, a separate off-spill rate, and optional lost (unstamped) hits.
+ * All times are kept in 10 ns VULOM ticks. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <regex>
+#include <thread>
+#include <chrono>
+
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <signal.h>
+
+#include "../common.hh"
+
+#define DEFAULT_STREAM_PORT 6002
+#define LMD_BUFSIZE (256 * 1024)   // Bytes, including the 48 byte buffer header.
+/* The unpacker chains up to MAX_TIMING_HITS stamps per readout; room for the trigger stamp. */
+#define MAX_HITS_PER_EVENT (MAX_TIMING_HITS - 1)
+#define TRIG_STAMP_DELAY 500       // ACCEPT_TRIG lands ~491..512 ticks before the latched clock.
+
+constexpr double clock_freq = 100'000'000.0;
+
+struct g_config_t {
+	double rate[4] = {1e5, 1e5, 1e5, 1e5};          // Hz, on-spill.
+	double offspill_rate[4] = {1e2, 1e2, 1e2, 1e2}; // Hz, between spills.
+	double spill_on = 1.0;   // seconds
+	double spill_off = 2.0;  // seconds
+	double ripple_amp = 0.0; // relative, 0..1
+	double ripple_freq = 50.0; // Hz
+	double lost_prob = 0.0;
+	double readout_period = 1e-3; // seconds, how often each channel FIFO is flushed.
+	uint32_t clock_start = 0x7ff00000; // 31-bit wrap after ~10 ms.
+	uint32_t nspills = 0;    // 0 = forever.
+	bool with_wr = false;
+	bool realtime = false;
+	uint64_t seed = 0x5eed;
+
+	std::string file_name;
+	int stream_port = -1;
+} g_config;
+
+static volatile sig_atomic_t g_stop = 0;
+
+/* ============ OUTPUT ============ */
+
+class Output {
+public:
+	virtual ~Output() = default;
+	virtual void write_buffer(const uint32_t* buf, size_t nbytes) = 0;
+};
+
+class FileOutput : public Output {
+	FILE* fp;
+public:
+	explicit FileOutput(const char* path) {
+		fp = fopen(path, "wb");
+		if(!fp) { YELL("Cannot open %s for writing.\n", path); perror("fopen"); exit(2); }
+	}
+	~FileOutput() { if(fp) fclose(fp); }
+	void write_buffer(const uint32_t* buf, size_t nbytes) override {
+		if(fwrite(buf, 1, nbytes, fp) != nbytes) { YELL("Short write.\n"); exit(2); }
+	}
+};
+
+/* Stand-in for the MBS/lwroc stream server: send the 16 byte info block on connect,
+ * then one stream (of `bufs_per_stream` buffers) per 12 byte "GETEVT" request.
+ * A single client at a time; the generator blocks while nobody is listening. */
+class StreamServerOutput : public Output {
+	int listen_fd = -1;
+	int client_fd = -1;
+	uint32_t bufs_left = 0;
+	static constexpr uint32_t bufs_per_stream = 1;
+
+	bool send_all(const void* p, size_t n) {
+		const char* c = static_cast<const char*>(p);
+		while(n > 0) {
+			ssize_t r = send(client_fd, c, n, MSG_NOSIGNAL);
+			if(r <= 0) return false;
+			c += r; n -= r;
+		}
+		return true;
+	}
+	bool recv_all(void* p, size_t n) {
+		char* c = static_cast<char*>(p);
+		while(n > 0) {
+			ssize_t r = recv(client_fd, c, n, 0);
+			if(r <= 0) return false;
+			c += r; n -= r;
+		}
+		return true;
+	}
+	void accept_client() {
+		WARN("Waiting for a client on port " EMPH(%d) " ..\n", g_config.stream_port);
+		while(!g_stop) {
+			client_fd = accept(listen_fd, nullptr, nullptr);
+			if(client_fd < 0) { perror("accept"); continue; }
+			uint32_t info[4] = {1, LMD_BUFSIZE, bufs_per_stream, 1}; // testbit, bufsize, bufs/stream, streams
+			if(send_all(info, sizeof(info))) break;
+			close(client_fd); client_fd = -1;
+		}
+		bufs_left = 0;
+		WARN("Client connected.\n");
+	}
+public:
+	explicit StreamServerOutput(int port) {
+		listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(port);
+		if(bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 or listen(listen_fd, 1) < 0) {
+			YELL("Unable to bind stream server to port %d .. Exiting.\n", port);
+			perror("bind"); exit(2);
+		}
+	}
+	~StreamServerOutput() {
+		if(client_fd >= 0) close(client_fd);
+		if(listen_fd >= 0) close(listen_fd);
+	}
+	void write_buffer(const uint32_t* buf, size_t nbytes) override {
+		while(!g_stop) {
+			if(client_fd < 0) accept_client();
+			if(bufs_left == 0) {
+				char request[12];
+				if(!recv_all(request, sizeof(request))) goto drop;
+				if(strncmp(request, "CLOSE", 5) == 0) goto drop;
+				bufs_left = bufs_per_stream;
+			}
+			if(!send_all(buf, nbytes)) goto drop;
+			--bufs_left;
+			return;
+		drop:
+			WARN("Client disconnected.\n");
+			close(client_fd); client_fd = -1;
+		}
+	}
+};
+
+/* Packs 10/1 events with one 10/1 subevent (procid=69, control=30) into fixed size
+ * LMD buffers of type 10/1. Events never span buffers. */
+class LmdWriter {
+	Output* out;
+	std::vector<uint32_t> buf;
+	size_t used = 0; // in 32-bit words, data field only.
+	uint32_t nevents = 0;
+	uint32_t bufno = 0;
+	uint32_t event_count = 0;
+	static constexpr size_t header_words = 12;
+	static constexpr size_t capacity = LMD_BUFSIZE / 4 - header_words;
+
+	void fill_header(uint32_t type, uint32_t subtype, uint32_t used_words, uint32_t nev) {
+		uint32_t used16 = used_words * 2;
+		time_t now = time(nullptr);
+		buf[0] = capacity * 2;                    // l_dlen, 16-bit words.
+		buf[1] = (subtype << 16) | type;          // i_subtype, i_type
+		buf[2] = used16 < 0x8000 ? used16 : 0;    // h_begin, h_end, i_used
+		buf[3] = bufno++;                         // l_buf
+		buf[4] = nev;                             // l_evt
+		buf[5] = 0;                               // l_current_i
+		buf[6] = (uint32_t)now; buf[7] = 0;       // l_time
+		buf[8] = 1;                               // l_free[0]: endian marker
+		buf[9] = 0;
+		buf[10] = used16;                         // l_free[2]: used length for large buffers
+		buf[11] = 0;
+	}
+public:
+	explicit LmdWriter(Output* out, bool file_header) : out(out), buf(LMD_BUFSIZE / 4, 0) {
+		if(file_header) {
+			fill_header(2000, 1, 0, 0);
+			out->write_buffer(buf.data(), LMD_BUFSIZE);
+			std::fill(buf.begin(), buf.end(), 0);
+		}
+	}
+	~LmdWriter() { flush(); }
+
+	/* `sub` holds the subevent payload. */
+	void add_event(uint32_t trigger, const uint32_t* sub, size_t nsub) {
+		size_t nwords = 4 + 3 + nsub;
+		if(nwords > capacity) { YELL("Event of %zu words does not fit an LMD buffer.\n", nwords); exit(1); }
+		if(used + nwords > capacity) flush();
+		uint32_t* w = buf.data() + header_words + used;
+		w[0] = (nwords - 2) * 2;             // l_dlen
+		w[1] = (1 << 16) | 10;               // i_subtype, i_type
+		w[2] = (trigger << 16);              // i_trigger, i_dummy
+		w[3] = ++event_count;                // l_count
+		w[4] = (3 + nsub - 2) * 2;           // subevent l_dlen
+		w[5] = (1 << 16) | 10;
+		w[6] = (30u << 24) | (0u << 16) | 69u; // h_control, h_subcrate, i_procid
+		memcpy(w + 7, sub, nsub * sizeof(uint32_t));
+		used += nwords;
+		++nevents;
+	}
+	void flush() {
+		if(nevents == 0) return;
+		fill_header(10, 1, used, nevents);
+		std::fill(buf.begin() + header_words + used, buf.end(), 0);
+		out->write_buffer(buf.data(), LMD_BUFSIZE);
+		used = 0; nevents = 0;
+	}
+};
+
+/* ============ HIT GENERATION ============ */
+
+struct Hit {
+	uint64_t t;       // 10 ns ticks since generator start.
+	uint32_t ecl;     // ECL_IN scaler right after this hit.
+	bool stamped;     // Else counted by the scaler only.
+	bool lost_before; // One or more hits right before this one were not stamped.
+};
+
+/* xoshiro256+, uniform doubles in [0,1). The std engines cost too much at 10 MHz. */
+class Rng {
+	uint64_t s[4];
+	static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+public:
+	explicit Rng(uint64_t seed) {
+		FOR(i,4) { // splitmix64
+			seed += 0x9e3779b97f4a7c15ULL;
+			uint64_t z = seed;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			s[i] = z ^ (z >> 31);
+		}
+	}
+	inline double operator()() {
+		uint64_t r = s[0] + s[3];
+		uint64_t t = s[1] << 17;
+		s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3];
+		s[2] ^= t; s[3] = rotl(s[3], 45);
+		return (r >> 11) * 0x1.0p-53;
+	}
+};
+
+class Channel {
+	Rng uni;
+	double rmax;     // Hz, thinning envelope.
+	double t_cand;   // seconds, next candidate time.
+	uint64_t last_tick = 0;
+	bool pending_lost = false;
+public:
+	int index;
+	uint32_t ecl = 0;         // ECL_IN scaler, counts every hit, stamped or not.
+	uint32_t ecl_latched = 0; // Scaler value of the last readout.
+	std::vector<Hit> fifo;
+
+	Channel(int i, uint64_t seed) : uni(seed), index(i) {
+		rmax = std::max(g_config.rate[i] * (1.0 + g_config.ripple_amp), g_config.offspill_rate[i]);
+		t_cand = (rmax > 0) ? -std::log(1.0 - uni()) / rmax : INFINITY;
+	}
+
+	static double rate_at(int i, double t, bool onspill) {
+		if(!onspill) return g_config.offspill_rate[i];
+		if(g_config.ripple_amp == 0) return g_config.rate[i];
+		return g_config.rate[i] * (1.0 + g_config.ripple_amp * std::sin(2 * M_PI * g_config.ripple_freq * t));
+	}
+
+	/* Produce all hits with time < `t_end` (seconds). Spill state is given by `onspill(t)`. */
+	template<typename F>
+	void generate_until(double t_end, F&& onspill) {
+		while(t_cand < t_end) {
+			double t = t_cand;
+			t_cand += -std::log(1.0 - uni()) / rmax;
+			double r = rate_at(index, t, onspill(t));
+			if(r < rmax and uni() * rmax > r) continue;
+			uint64_t tick = static_cast<uint64_t>(t * clock_freq);
+			if(tick <= last_tick) tick = last_tick + 1; // One stamp per 10 ns at most.
+			last_tick = tick;
+			++ecl;
+			/* Lost hits stay in the FIFO too, the scaler latched at a readout counts them. */
+			if(g_config.lost_prob > 0 and uni() < g_config.lost_prob) {
+				fifo.push_back({tick, ecl, false, false});
+				pending_lost = true;
+				continue;
+			}
+			fifo.push_back({tick, ecl, true, pending_lost});
+			pending_lost = false;
+		}
+	}
+};
+
+class EventBuilder {
+	std::vector<uint32_t> w;
+	uint64_t wr_start;
+public:
+	EventBuilder() {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		wr_start = ts.tv_nsec + (uint64_t)ts.tv_sec * 1000000000ULL
+			+ 1000000000ULL * (LEAP_SECONDS + TAI_AHEAD_OF_UTC);
+	}
+
+	static uint32_t clock32(uint64_t tick) { return static_cast<uint32_t>(g_config.clock_start + tick); }
+
+	/* Readout of one channel's FIFO at tick `clk`, by trigger `trig` (1..4, 12 = BoS, 13 = EoS). */
+	void build(LmdWriter& lmd, uint32_t trig, uint64_t clk, Channel& ch,
+	           const Hit* hits, size_t nhits, bool with_trig_stamp) {
+		w.clear();
+		if(g_config.with_wr) {
+			uint64_t ts = wr_start + clk * 10;
+			w.push_back(0x100);
+			w.push_back((0x03e1u << 16) | (uint32_t)(ts & 0xffff));
+			w.push_back((0x04e1u << 16) | (uint32_t)((ts >> 16) & 0xffff));
+			w.push_back((0x05e1u << 16) | (uint32_t)((ts >> 32) & 0xffff));
+			w.push_back((0x06e1u << 16) | (uint32_t)((ts >> 48) & 0xffff));
+		}
+		w.push_back(0xbeefbabe);
+		w.push_back((trig << 24) | (1u << (trig - 1)));
+		if(nhits > 0) ch.ecl_latched = hits[nhits-1].ecl; // After all hits before `clk`, lost ones included.
+		w.push_back(ch.ecl_latched);
+		w.push_back(clock32(clk));
+
+		/* The trigger input shows up as an extra stamp in the first FIFO, ~500 ticks before
+		 * the latched clock. Keep the list sorted in time. */
+		std::vector<uint32_t> stamps; stamps.reserve(nhits + 1);
+		uint64_t trig_tick = clk - TRIG_STAMP_DELAY;
+		bool trig_done = !with_trig_stamp;
+		FOR(i, nhits) {
+			if(!hits[i].stamped) continue;
+			if(!trig_done and hits[i].t > trig_tick) {
+				stamps.push_back(clock32(trig_tick) & 0x7fffffff);
+				trig_done = true;
+			}
+			uint32_t v = clock32(hits[i].t) & 0x7fffffff;
+			if(hits[i].lost_before) v |= 0x80000000;
+			stamps.push_back(v);
+		}
+		if(!trig_done) stamps.push_back(clock32(trig_tick) & 0x7fffffff);
+
+		/* Full MVLC frames with the continuation header 0xf580, then the last one with 0xf500. */
+		size_t n = stamps.size();
+		size_t done = 0;
+		while(n - done > MAX_FRAME_HITS) {
+			w.push_back((0xf580u << 16) | (uint32_t)MAX_FRAME_HITS);
+			w.insert(w.end(), stamps.begin() + done, stamps.begin() + done + MAX_FRAME_HITS);
+			done += MAX_FRAME_HITS;
+		}
+		w.push_back((0xf500u << 16) | (uint32_t)(n - done));
+		w.insert(w.end(), stamps.begin() + done, stamps.end());
+
+		lmd.add_event(trig, w.data(), w.size());
+	}
+};
+
+/* ============ COMMAND LINE ============ */
+
+void usage(const char* argv0) {
+	printf("Usage: %s [OPTS]\n", argv0);
+	printf(EMPH(Synthetic MVLC/TRLOII data source) "\n");
+	printf(BOLD "  --rate=R, --rate_i=R    " KNRM "On-spill hit rate in Hz, for all / " BOLD "i" KNRM "th channel. Default %.0f.\n", 1e5);
+	printf(BOLD "  --offspill_rate[_i]=R   " KNRM "Off-spill hit rate in Hz. Default %.0f.\n", 1e2);
+	printf(BOLD "  --spill=ON,OFF          " KNRM "Spill on and off durations in seconds. Default 1.0,2.0.\n");
+	printf(BOLD "  --ripple=A,F            " KNRM "Relative ripple amplitude A (0..1) at frequency F in Hz. Default off.\n");
+	printf(BOLD "  --lost=P                " KNRM "Probability that a hit is counted but not stamped. Default 0.\n");
+	printf(BOLD "  --readout=T             " KNRM "FIFO readout period in seconds. Default 1e-3.\n");
+	printf(BOLD "  --clock_start=C         " KNRM "Initial 32-bit VULOM clock. Default 0x7ff00000 (31-bit wrap after ~10 ms).\n");
+	printf(BOLD "  --wr                    " KNRM "Prepend the Whiterabbit block.\n");
+	printf(BOLD "  --spills=N              " KNRM "Stop after N spills. Default: run forever.\n");
+	printf(BOLD "  --realtime              " KNRM "Pace the output to wall clock. Default: as fast as the consumer reads.\n");
+	printf(BOLD "  --seed=S                " KNRM "Random seed.\n");
+	printf(BOLD "  --file=PATH             " KNRM "Write an LMD file.\n");
+	printf(BOLD "  --stream[,port=N]       " KNRM "Serve as a stream server. Default port %d.\n", DEFAULT_STREAM_PORT);
+}
+
+bool handle_command_line_option(const char *arg) {
+#define MATCH_PREFIX(prefix,post) (strncmp(arg,prefix,strlen(prefix)) == 0 and *(post = arg + strlen(prefix)) != '\0')
+#define MATCH_ARG(name) (strcmp(arg,name) == 0)
+	const char* post;
+	std::cmatch m;
+	const std::regex re_num(R"(^(_[1-4])?=([0-9.eE+-]+)$)");
+
+	if(MATCH_ARG("--wr")) { g_config.with_wr = true; return true; }
+	if(MATCH_ARG("--realtime")) { g_config.realtime = true; return true; }
+	if(MATCH_ARG("--stream")) { g_config.stream_port = DEFAULT_STREAM_PORT; return true; }
+	if(MATCH_PREFIX("--stream,port=", post)) { g_config.stream_port = atoi(post); return g_config.stream_port > 0; }
+	if(MATCH_PREFIX("--file=", post)) { g_config.file_name = post; return true; }
+	if(MATCH_PREFIX("--spills=", post)) { g_config.nspills = strtoul(post, nullptr, 0); return true; }
+	if(MATCH_PREFIX("--seed=", post)) { g_config.seed = strtoull(post, nullptr, 0); return true; }
+	if(MATCH_PREFIX("--clock_start=", post)) { g_config.clock_start = strtoul(post, nullptr, 0); return true; }
+	if(MATCH_PREFIX("--lost=", post)) {
+		g_config.lost_prob = atof(post);
+		return g_config.lost_prob >= 0 and g_config.lost_prob < 1;
+	}
+	if(MATCH_PREFIX("--readout=", post)) {
+		g_config.readout_period = atof(post);
+		return g_config.readout_period >= 1e-6;
+	}
+	if(MATCH_PREFIX("--spill=", post)) {
+		return sscanf(post, "%lf,%lf", &g_config.spill_on, &g_config.spill_off) == 2
+			and g_config.spill_on > 0 and g_config.spill_off > 0;
+	}
+	if(MATCH_PREFIX("--ripple=", post)) {
+		return sscanf(post, "%lf,%lf", &g_config.ripple_amp, &g_config.ripple_freq) == 2
+			and g_config.ripple_amp >= 0 and g_config.ripple_amp <= 1;
+	}
+	for(auto [prefix, dest] : {std::make_pair("--rate", g_config.rate),
+	                           std::make_pair("--offspill_rate", g_config.offspill_rate)}) {
+		if(MATCH_PREFIX(prefix, post) and std::regex_match(post, m, re_num)) {
+			double val = atof(m[2].str().c_str());
+			if(val < 0) return false;
+			if(m[1].matched) dest[m[1].str()[1] - '1'] = val;
+			else FOR(k,4) dest[k] = val;
+			return true;
+		}
+	}
+	return false;
+#undef MATCH_PREFIX
+#undef MATCH_ARG
+}
+
+/* ============ MAIN ============ */
+
+int main(int argc, char** argv) {
+	for(int i=1; i<argc; ++i) {
+		if(strcmp(argv[i], "--help") == 0) { usage(argv[0]); return 0; }
+		if(!handle_command_line_option(argv[i])) {
+			YELL("Bad option: %s\n", argv[i]); usage(argv[0]); return 1;
+		}
+	}
+	if(g_config.file_name.empty() == (g_config.stream_port < 0)) {
+		YELL("Give exactly one of --file=PATH or --stream.\n"); return 1;
+	}
+	signal(SIGINT, [](int) { g_stop = 1; });
+	signal(SIGPIPE, SIG_IGN);
+
+	Output* out;
+	if(!g_config.file_name.empty()) out = new FileOutput(g_config.file_name.c_str());
+	else out = new StreamServerOutput(g_config.stream_port);
+	LmdWriter* lmd = new LmdWriter(out, !g_config.file_name.empty());
+	EventBuilder builder;
+
+	std::vector<Channel> ch;
+	FOR(i,4) ch.emplace_back(i, g_config.seed * 4 + i);
+
+	const double period = g_config.spill_on + g_config.spill_off;
+	const double t0 = 0.1; // First BoS, seconds.
+	/* Per-hit query, so cache the current on/off window. */
+	double win_lo = 0.0, win_hi = t0;
+	bool win_on = false;
+	auto onspill = [&](double t) {
+		if(t >= win_lo and t < win_hi) return win_on;
+		if(t < t0) return false;
+		double k = std::floor((t - t0) / period);
+		double start = t0 + k * period;
+		win_on = (t - start) < g_config.spill_on;
+		win_lo = win_on ? start : start + g_config.spill_on;
+		win_hi = win_on ? start + g_config.spill_on : start + period;
+		return win_on;
+	};
+	auto to_tick = [](double t) { return static_cast<uint64_t>(t * clock_freq); };
+
+	/* Flush `c`'s FIFO by trigger `trig` latched at `clk`; hits stamped after `clk` stay.
+	 * A FIFO holding more than one event's worth gets read out early by its own trigger. */
+	auto readout = [&](Channel& c, uint32_t trig, uint64_t clk, bool with_trig_stamp) {
+		size_t n = 0;
+		while(n < c.fifo.size() and c.fifo[n].t < clk) ++n;
+		size_t done = 0;
+		while(n - done > MAX_HITS_PER_EVENT) {
+			const Hit* h = c.fifo.data() + done;
+			builder.build(*lmd, c.index + 1, h[MAX_HITS_PER_EVENT-1].t + 1, c, h, MAX_HITS_PER_EVENT, false);
+			done += MAX_HITS_PER_EVENT;
+		}
+		if(n > done or with_trig_stamp)
+			builder.build(*lmd, trig, clk, c, c.fifo.data() + done, n - done, with_trig_stamp);
+		c.fifo.erase(c.fifo.begin(), c.fifo.begin() + n);
+	};
+
+	auto wall_start = std::chrono::steady_clock::now();
+	auto wall_report = wall_start;
+	uint64_t hits_total = 0, hits_reported = 0;
+	uint32_t spill = 0;
+	double t = 0.0;
+	double next_bos = t0, next_eos = t0 + g_config.spill_on;
+	const double dt_ro = g_config.readout_period;
+
+	while(!g_stop and (g_config.nspills == 0 or spill < g_config.nspills)) {
+		double t_next = t + dt_ro;
+		/* Spill edges inside this readout slice come first, in time order. */
+		for(;;) {
+			bool bos = next_bos < next_eos;
+			double te = bos ? next_bos : next_eos;
+			if(te >= t_next) break;
+			uint64_t clk = to_tick(te) + TRIG_STAMP_DELAY;
+			ch[0].generate_until(clk / clock_freq, onspill);
+			readout(ch[0], bos ? 12 : 13, clk, true);
+			if(bos) next_bos += period;
+			else { next_eos += period; ++spill; lmd->flush(); }
+		}
+		for(auto& c : ch) {
+			c.generate_until(t_next, onspill);
+			readout(c, c.index + 1, to_tick(t_next), false);
+		}
+		t = t_next;
+
+		auto now = std::chrono::steady_clock::now();
+		if(g_config.realtime) {
+			auto target = wall_start + std::chrono::duration<double>(t);
+			if(target > now) {
+				lmd->flush();
+				std::this_thread::sleep_until(target);
+			}
+		}
+		double since_report = std::chrono::duration<double>(now - wall_report).count();
+		if(since_report > 5.0) {
+			hits_total = 0;
+			for(auto& c : ch) hits_total += c.ecl;
+			WARN("Spill %u, generated %.2f MHz of hits over the last %.1f s (%.2f x real time).\n",
+				spill, (hits_total - hits_reported) / since_report / 1e6, since_report,
+				std::chrono::duration<double>(now - wall_start).count() > 0 ?
+					t / std::chrono::duration<double>(now - wall_start).count() : 0.0);
+			hits_reported = hits_total;
+			wall_report = now;
+		}
+	}
+	delete lmd;
+	delete out;
+	hits_total = 0;
+	for(auto& c : ch) hits_total += c.ecl;
+	WARN("Done: %u spills, %lu hits.\n", spill, (unsigned long)hits_total);
+	return 0;
+}
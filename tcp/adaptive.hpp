@@ -0,0 +1,108 @@
+/* Adaptive binning of the microspill spectrum, also #include'd into the main user fnc .cc file.
+ * Bayesian-blocks style, on the FINE_BINS_MICRO equal-log bins of `MicrospillHist::fine`:
+ * a block of N hits spanning T fine bins has the (Cash) fitness N log(N / T), and each block
+ * costs a prior of ncp_prior (Scargle et al. 2013, eq. 21, with false-positive rate p0).
+ * Instead of the exact O(n^2) dynamic program, start from the fine bins and greedily merge the
+ * neighbouring pair losing the least fitness, for as long as that loss is below the prior.
+ * With a heap and lazy invalidation that's O(n log n) in the number of fine bins. */
+
+#include <queue>
+
+#define DEFAULT_ADAPTIVE_P0 0.05
+
+struct AdaptiveBlock {
+	uint32_t lo, hi;   // Fine bins [lo, hi).
+	uint64_t n;
+	int prev, next;    // Neighbours, -1 at the ends.
+	uint32_t version;  // Bumped at every merge, invalidates the queued pairs.
+	bool alive;
+};
+
+inline double block_fitness(uint64_t n, uint32_t width) {
+	return n ? n * std::log((double)n / width) : 0.0;
+}
+
+struct MergeCandidate {
+	double loss;
+	int left, right;
+	uint32_t v_left, v_right;
+	bool operator>(const MergeCandidate& o) const { return loss > o.loss; }
+};
+
+/* Returns the edges (in fine bin indices, one more than the blocks) and the hits per block. */
+std::pair<std::vector<uint32_t>, std::vector<uint64_t>> adaptive_blocks(const uint32_t* fine, uint32_t nfine, double p0) {
+	std::vector<uint32_t> edges;
+	std::vector<uint64_t> counts;
+
+	uint32_t first = 0, last = nfine;
+	while(first < nfine and fine[first] == 0) ++first;
+	while(last > first and fine[last - 1] == 0) --last;
+	if(first == last) return {edges, counts};
+
+	std::vector<AdaptiveBlock> b;
+	b.reserve(last - first);
+	uint64_t total = 0;
+	for(uint32_t i = first; i < last; ++i) {
+		int k = b.size();
+		b.push_back({i, i + 1, fine[i], k - 1, (i + 1 < last) ? k + 1 : -1, 0, true});
+		total += fine[i];
+	}
+	const double ncp_prior = 4 - std::log(73.53 * p0 * std::pow((double)total, -0.478));
+
+	auto loss = [&](int l, int r) {
+		return block_fitness(b[l].n, b[l].hi - b[l].lo) + block_fitness(b[r].n, b[r].hi - b[r].lo)
+			- block_fitness(b[l].n + b[r].n, b[r].hi - b[l].lo);
+	};
+	std::vector<MergeCandidate> storage;
+	storage.reserve(3 * b.size());
+	std::priority_queue<MergeCandidate, std::vector<MergeCandidate>, std::greater<MergeCandidate>> heap(
+		std::greater<MergeCandidate>(), std::move(storage));
+	for(int k = 0; k + 1 < (int)b.size(); ++k) heap.push({loss(k, k + 1), k, k + 1, 0, 0});
+
+	while(!heap.empty()) {
+		MergeCandidate c = heap.top();
+		if(c.loss >= ncp_prior) break;
+		heap.pop();
+		AdaptiveBlock& l = b[c.left];
+		AdaptiveBlock& r = b[c.right];
+		if(!l.alive or !r.alive or l.version != c.v_left or r.version != c.v_right) continue;
+
+		l.hi = r.hi;
+		l.n += r.n;
+		l.next = r.next;
+		++l.version;
+		r.alive = false;
+		if(l.next >= 0) b[l.next].prev = c.left;
+
+		if(l.prev >= 0) heap.push({loss(l.prev, c.left), l.prev, c.left, b[l.prev].version, l.version});
+		if(l.next >= 0) heap.push({loss(c.left, l.next), c.left, l.next, l.version, b[l.next].version});
+	}
+
+	for(int k = 0; k >= 0; k = b[k].next) {
+		edges.push_back(b[k].lo);
+		counts.push_back(b[k].n);
+	}
+	edges.push_back(last);
+	return {edges, counts};
+}
+
+/* x in the same units as `binx` (log10 of seconds), y as `biny` but of the hit density,
+ * scaled to the width of the regular bins so the two overlay. */
+json adaptive_to_json(const MicrospillHist& hist, double p0) {
+	auto [edges, counts] = adaptive_blocks(hist.fine, FINE_BINS_MICRO, p0);
+	const double fine_width = hist.max_range_log / FINE_BINS_MICRO;
+	const double regular_width = hist.max_range_log / hist.nbins;
+
+	std::vector<double> xs, ys;
+	for(uint32_t e : edges) xs.push_back(fine_width * e - 8);
+	FOR(k, counts.size()) {
+		counts[k] *= hist.prescale; // The blocks are found on the hits actually filled.
+		double width = fine_width * (edges[k + 1] - edges[k]);
+		ys.push_back(llog10(counts[k] * regular_width / width));
+	}
+	json j;
+	j["edges_x"] = std::move(xs);
+	j["counts"] = std::move(counts);
+	j["y"] = std::move(ys);
+	return j;
+}
@@ -0,0 +1,111 @@
+/* Micro-burst segmentation, also #include'd into the main user fnc .cc file.
+ * Filled per hit by the hit kernel, right along the quality statistics, in O(1): consecutive
+ * hits closer than `gap` (in 10 ns) belong to the same cluster, and a cluster of at least
+ * `min_hits` hits is a burst. At EoS the running cluster is closed, and the bursts of the
+ * spill are summarized as log2-binned histograms of their length, their hits and of the
+ * gaps between them (from the last hit of one burst to the first hit of the next). */
+
+#define BURST_BINS 41 // Bin 0 holds 0, bin k holds [2^(k-1), 2^k).
+#define DEFAULT_BURST_MIN_HITS 2
+
+inline uint32_t log2_bin(uint64_t x) {
+	uint32_t b = x ? 64 - __builtin_clzll(x) : 0;
+	return std::min(b, (uint32_t)BURST_BINS - 1);
+}
+
+class BurstStats {
+	bool started;
+	uint64_t cur_hits, cur_len;  // Running cluster.
+	uint64_t idle;               // Since the end of the last burst, up to the start of the running cluster.
+	bool have_burst;
+
+	void close_cluster() {
+		if(cur_hits >= min_hits) {
+			++nbursts;
+			hits_in_bursts += cur_hits;
+			++length[log2_bin(cur_len)];
+			++hits[log2_bin(cur_hits)];
+			if(have_burst) ++gaps[log2_bin(idle)];
+			have_burst = true;
+			idle = 0;
+		}
+		else {
+			idle += cur_len;
+		}
+	}
+public:
+	uint32_t gap = 0;  // [10 ns], 0 = off.
+	uint32_t min_hits = DEFAULT_BURST_MIN_HITS;
+
+	uint64_t nbursts;
+	uint64_t hits_in_bursts;
+	uint64_t total_hits;
+	uint32_t length[BURST_BINS]; // [10 ns]
+	uint32_t hits[BURST_BINS];
+	uint32_t gaps[BURST_BINS];   // [10 ns]
+
+	BurstStats() { reset(); }
+	bool enabled() const { return gap > 0; }
+
+	void reset() {
+		started = false;
+		cur_hits = 0; cur_len = 0;
+		idle = 0;
+		have_burst = false;
+		nbursts = 0; hits_in_bursts = 0; total_hits = 0;
+		memset(length, 0, sizeof(length));
+		memset(hits, 0, sizeof(hits));
+		memset(gaps, 0, sizeof(gaps));
+	}
+
+	/* The first hit of the spill only opens a cluster, its `dt` reaches back before BoS. */
+	inline void fill(uint32_t dt) {
+		++total_hits;
+		if(!started) { started = true; cur_hits = 1; return; }
+		if(dt & 0x80000000) {
+			/* Backwards counting, see `Scaler::calc_increment`: the time since the previous hit
+			 * is unknown, so the hit opens a new cluster, and no gap is measured up to it. */
+			close_cluster();
+			have_burst = false;
+			idle = 0;
+			cur_hits = 1;
+			cur_len = 0;
+			return;
+		}
+		if(dt < gap) {
+			++cur_hits;
+			cur_len += dt;
+			return;
+		}
+		close_cluster();
+		idle += dt;
+		cur_hits = 1;
+		cur_len = 0;
+	}
+
+	/* At EoS. */
+	void finish() {
+		if(started) close_cluster();
+		started = false;
+	}
+
+	json to_json() const {
+		auto trimmed = [](const uint32_t (&h)[BURST_BINS]) {
+			uint32_t n = BURST_BINS;
+			while(n > 0 and h[n - 1] == 0) --n;
+			return std::vector<uint32_t>(h, h + n);
+		};
+		json j;
+		j["gap_10ns"] = gap;
+		j["min_hits"] = min_hits;
+		j["count"] = nbursts;
+		j["hits_in_bursts"] = hits_in_bursts;
+		j["fraction_in_bursts"] = total_hits ? (double)hits_in_bursts / total_hits : 0.0;
+		j["length_10ns_log2"] = trimmed(length);
+		j["hits_log2"] = trimmed(hits);
+		j["gap_10ns_log2"] = trimmed(gaps);
+		return j;
+	}
+};
+
+BurstStats burst[4];
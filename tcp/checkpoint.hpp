@@ -0,0 +1,258 @@
+/* Warm restart, also #include'd into the main user fnc .cc file.
+ * The unpacker state (scalers, spill counter and status, the histograms of the open spill and
+ * the reconfigurable settings) is copied at every BoS and EoS, and every `--checkpoint_period`
+ * in between, into a memory-mapped file. The two slots of the file are written alternately,
+ * so a crash while copying leaves the previous one intact.
+ * On startup the newest slot is loaded if it's younger than CHECKPOINT_MAX_AGE, and restored at
+ * the first event if the VULOM clock (and Whiterabbit, if present) advanced by the wall time
+ * passed since it was written, i.e. it's still the same DAQ run. Hits in between are lost.
+ * A channel whose last stamp is by then older than CHECKPOINT_MAX_STAMP_AGE starts its
+ * unwrapping afresh, as at startup. */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CHECKPOINT_MAGIC 0x4d53434b // "MSCK"
+#define CHECKPOINT_VERSION 3
+/* [s], the 32-bit scalers (VULOM clock, ECL_IN(x)) tell a wrap from counting backwards
+ * only within 3/4 of their ~43 s period, i.e. ~32 s. */
+#define CHECKPOINT_MAX_AGE 30.0
+/* [s], the same for the 31-bit hit stamps: ~16 s. Checked per channel in `restore`. */
+#define CHECKPOINT_MAX_STAMP_AGE 15.0
+#define CHECKPOINT_CLOCK_TOLERANCE 1.0  // [s]
+#define DEFAULT_CHECKPOINT_PERIOD 1.0   // [s]
+#define CHECKPOINT_NAME_LEN 64
+
+static_assert(std::is_trivially_copyable_v<MacrospillHist> and std::is_trivially_copyable_v<SpillQuality>
+	and std::is_trivially_copyable_v<PhaseFold> and std::is_trivially_copyable_v<Scaler<>>
+	and std::is_trivially_copyable_v<BurstStats>);
+
+/* The trivially copyable part of `MicrospillHist`. */
+struct CheckpointMicro {
+	uint32_t max_range;
+	int32_t hits_counted;
+	uint32_t overflows;
+	uint32_t ecl_start, ecl_end;
+	uint32_t start_ts, end_ts;
+	uint32_t prescale, countdown;
+	bool has_fine;
+	uint32_t arr[MAX_BINS_MICRO];
+	uint32_t fine[FINE_BINS_MICRO];
+};
+
+struct CheckpointState {
+	uint64_t seq;      // 0 = invalid, written last.
+	uint64_t wall_ns;  // CLOCK_REALTIME.
+	uint64_t wr_ns;    // Of the last event, 0 without Whiterabbit.
+	uint32_t clk;      // VULOM clock of the last event.
+
+	uint32_t bos_ts, eos_ts, spill_number;
+	uint64_t bos_wr;
+	SpillStatus spill_status;
+	uint64_t wr_prev;
+	Scaler<> ecl_in[4], vulom_time[4];
+	Scaler<31> last_ts[4];
+
+	char name[4][CHECKPOINT_NAME_LEN];
+	int nbins_micro[4];
+	int max_range_micro[4];
+	double acc_period_macro[4];
+	FoldConfig fold_config;
+
+	CheckpointMicro micro[4];
+	MacrospillHist macro[4];
+	SpillQuality quality[4];
+	PhaseFold fold[4];
+	BurstStats burst[4];
+};
+
+struct CheckpointFile {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	CheckpointState slot[2];
+};
+
+inline uint64_t wall_clock_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class Checkpoint {
+	CheckpointFile* file = nullptr;
+	uint64_t seq = 0;
+	uint64_t next_due = 0;
+	const CheckpointState* staged = nullptr;
+	uint32_t last_clk = 0;    // Of the last event seen.
+	uint64_t last_wr = 0;
+	bool seen_event = false;
+
+	void save_micro(CheckpointMicro& c, const MicrospillHist& h) {
+		c.max_range = h.get_range();
+		c.hits_counted = h.hits_counted;
+		c.overflows = h.overflows;
+		c.ecl_start = h.ecl_start; c.ecl_end = h.ecl_end;
+		c.start_ts = h.start_ts; c.end_ts = h.end_ts;
+		c.prescale = h.prescale; c.countdown = h.countdown;
+		memcpy(c.arr, h.arr, sizeof(c.arr));
+		c.has_fine = h.fine_scale != 0;
+		if(c.has_fine) memcpy(c.fine, h.fine, sizeof(c.fine));
+	}
+	void load_micro(const CheckpointMicro& c, MicrospillHist& h) {
+		h.hits_counted = c.hits_counted;
+		h.overflows = c.overflows;
+		h.ecl_start = c.ecl_start; h.ecl_end = c.ecl_end;
+		h.start_ts = c.start_ts; h.end_ts = c.end_ts;
+		h.prescale = c.prescale; h.countdown = c.countdown;
+		memcpy(h.arr, c.arr, sizeof(h.arr));
+		if(c.has_fine and h.fine_scale != 0) memcpy(h.fine, c.fine, sizeof(h.fine));
+	}
+
+	/* Same run: the clocks advanced by the wall time passed. */
+	bool consistent(const CheckpointState& s, unpack_event *event) const {
+		double wall = (wall_clock_ns() - s.wall_ns) / 1e9;
+		double clk = (uint32_t)(event->trloii_mvlc.header.clk.value - s.clk) / clock_freq;
+		if(std::abs(clk - wall) > CHECKPOINT_CLOCK_TOLERANCE) return false;
+		uint64_t wr = wr_of(event);
+		if(s.wr_ns and wr) {
+			if(std::abs((int64_t)(wr - s.wr_ns) / 1e9 - wall) > CHECKPOINT_CLOCK_TOLERANCE) return false;
+		}
+		return true;
+	}
+public:
+	double period = DEFAULT_CHECKPOINT_PERIOD;
+
+	/* Maps `path`, creating it if needed, and stages its newest slot for `restore`. */
+	bool open(const char* path) {
+		int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+		if(fd < 0) return false;
+		struct stat st;
+		bool fresh = fstat(fd, &st) != 0 or (size_t)st.st_size != sizeof(CheckpointFile);
+		if(fresh and ftruncate(fd, sizeof(CheckpointFile)) != 0) { ::close(fd); return false; }
+		void* p = mmap(nullptr, sizeof(CheckpointFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(p == MAP_FAILED) return false;
+		file = static_cast<CheckpointFile*>(p);
+
+		if(fresh or file->magic != CHECKPOINT_MAGIC or file->version != CHECKPOINT_VERSION
+		   or file->size != sizeof(CheckpointFile)) {
+			memset(static_cast<void*>(file), 0, sizeof(CheckpointFile));
+			file->magic = CHECKPOINT_MAGIC;
+			file->version = CHECKPOINT_VERSION;
+			file->size = sizeof(CheckpointFile);
+			return true;
+		}
+		const CheckpointState& newest = (file->slot[0].seq > file->slot[1].seq) ? file->slot[0] : file->slot[1];
+		seq = newest.seq;
+		double age = ((int64_t)(wall_clock_ns() - newest.wall_ns)) / 1e9;
+		if(newest.seq == 0) return true;
+		if(age < 0 or age > CHECKPOINT_MAX_AGE) {
+			WARN("Checkpoint in %s is %.0f s old, starting afresh.\n", path, age);
+			return true;
+		}
+		staged = &newest;
+		WARN("Checkpoint in %s from %.1f s ago, spill %u, will be restored if the first event matches.\n",
+			path, age, newest.spill_number);
+		return true;
+	}
+
+	bool is_open() const { return file != nullptr; }
+
+	/* First event, before anything else touches the scalers. */
+	void restore(unpack_event *event) {
+		if(!staged) return;
+		const CheckpointState& s = *staged;
+		staged = nullptr;
+		if(!consistent(s, event)) {
+			WARN("Checkpoint doesn't match the clocks of the running DAQ, starting afresh.\n");
+			return;
+		}
+		bos_ts = s.bos_ts; eos_ts = s.eos_ts;
+		spill_number = s.spill_number;
+		bos_wr = s.bos_wr;
+		spill_status = s.spill_status;
+		wr_prev = s.wr_prev;
+		FOR(i,4) {
+			ecl_in[i] = s.ecl_in[i];
+			vulom_time[i] = s.vulom_time[i];
+			last_ts[i] = s.last_ts[i];
+			if(!last_ts[i].is_in_init()) {
+				/* The stamps run on the VULOM clock: their age at the checkpoint, plus the clock time since. */
+				int32_t at_checkpoint = std::max(0, Scaler<31>::calc_diff(s.clk, last_ts[i].curr_data));
+				uint64_t age = (uint64_t)at_checkpoint + (uint32_t)(event->trloii_mvlc.header.clk.value - s.clk);
+				if(age > CHECKPOINT_MAX_STAMP_AGE * clock_freq) last_ts[i] = Scaler<31>();
+			}
+			g_config.name[i] = s.name[i];
+			g_config.nbins_micro[i] = s.nbins_micro[i];
+			g_config.max_range_micro[i] = s.max_range_micro[i];
+			g_config.acc_period_macro[i] = s.acc_period_macro[i];
+		}
+		apply_config();
+		control.rebase(g_config);
+		FOR(i,4) {
+			load_micro(s.micro[i], micro[i]);
+			Macro[i] = s.macro[i];
+			quality[i] = s.quality[i];
+			if(s.fold_config.ncand == fold_config.ncand and s.fold_config.nbins == fold_config.nbins
+			   and s.fold_config.period_ns == fold_config.period_ns and s.fold_config.scan_ns == fold_config.scan_ns)
+				fold[i] = s.fold[i];
+			if(s.burst[i].gap == burst[i].gap and s.burst[i].min_hits == burst[i].min_hits) burst[i] = s.burst[i];
+		}
+		WARN("Restored the checkpoint, continuing with spill %u.\n", spill_number + 1);
+	}
+
+	/* After each event; `force` at BoS and EoS. */
+	void maybe_write(unpack_event *event, bool force) {
+		last_clk = event->trloii_mvlc.header.clk.value;
+		last_wr = wr_of(event);
+		seen_event = true;
+		uint64_t now = wall_clock_ns();
+		if(!force and now < next_due) return;
+		next_due = now + static_cast<uint64_t>(period * 1e9);
+		write(now);
+	}
+
+	void write(uint64_t now) {
+		hit_batch.flush_all();
+		CheckpointState& s = file->slot[(seq + 1) & 1];
+		s.seq = 0;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		s.wall_ns = now;
+		s.wr_ns = last_wr;
+		s.clk = last_clk;
+		s.bos_ts = bos_ts; s.eos_ts = eos_ts;
+		s.spill_number = spill_number;
+		s.bos_wr = bos_wr;
+		s.spill_status = spill_status;
+		s.wr_prev = wr_prev;
+		FOR(i,4) {
+			s.ecl_in[i] = ecl_in[i];
+			s.vulom_time[i] = vulom_time[i];
+			s.last_ts[i] = last_ts[i];
+			snprintf(s.name[i], CHECKPOINT_NAME_LEN, "%s", g_config.name[i].c_str());
+			s.nbins_micro[i] = g_config.nbins_micro[i];
+			s.max_range_micro[i] = g_config.max_range_micro[i];
+			s.acc_period_macro[i] = g_config.acc_period_macro[i];
+			save_micro(s.micro[i], micro[i]);
+			s.macro[i] = Macro[i];
+			s.quality[i] = quality[i];
+			s.fold[i] = fold[i];
+			s.burst[i] = burst[i];
+		}
+		s.fold_config = fold_config;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		s.seq = ++seq;
+	}
+
+	/* At exit, so a clean restart loses only the hits while it's down. */
+	void close() {
+		if(file and seen_event) write(wall_clock_ns());
+		if(file) munmap(file, sizeof(CheckpointFile));
+		file = nullptr;
+	}
+};
+
+Checkpoint checkpoint;
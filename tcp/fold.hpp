@@ -0,0 +1,130 @@
+/* Folding of the hit times modulo a period (accelerator RF, power-supply ripple), also
+ * #include'd into the main user fnc .cc file. Filled per hit by the hit kernel with the
+ * hit time since BoS, in integer 10 ns ticks; the periods are fixed point with FOLD_FRAC_BITS
+ * fractional bits. The remainder uses a precomputed reciprocal instead of a division,
+ * so each candidate period costs a couple of multiplications per hit.
+ * With several candidate periods (a scan around the nominal one), the one with the most
+ * structured phase histogram (largest epoch-folding chi^2 against a flat one) is reported. */
+
+#define FOLD_FRAC_BITS 8
+#define FOLD_MAX_CANDIDATES 64
+#define FOLD_MAX_BINS 128
+#define FOLD_DEFAULT_BINS 32
+
+struct FoldConfig {
+	uint32_t ncand = 0;          // 0 = folding off.
+	uint32_t nbins = FOLD_DEFAULT_BINS;
+	double period_ns = 0;        // Nominal period.
+	double scan_ns = 0;          // Candidates spread evenly over [period - scan, period + scan].
+};
+
+class PhaseFold {
+	uint32_t ncand = 0;
+	uint32_t nbins = FOLD_DEFAULT_BINS;
+	uint64_t period[FOLD_MAX_CANDIDATES];  // Fixed point ticks.
+	uint64_t inv[FOLD_MAX_CANDIDATES];     // floor(2^64 / period).
+	uint64_t bin_scale[FOLD_MAX_CANDIDATES]; // floor(nbins * 2^32 / period).
+
+	int64_t t = 0;     // Hit time since BoS [10 ns], hits before BoS aren't folded.
+	bool skip_first = false;
+	uint32_t prescale = 1;  // Only every `prescale`-th hit is folded, see `tcp/shed.hpp`.
+	uint32_t countdown = 1;
+public:
+	uint32_t counts[FOLD_MAX_CANDIDATES][FOLD_MAX_BINS];
+	uint64_t folded = 0;
+
+	PhaseFold() { reset(); }
+
+	/* Returns false if the periods don't fit. */
+	bool configure(const FoldConfig& c) {
+		if(c.ncand > FOLD_MAX_CANDIDATES or c.nbins < 2 or c.nbins > FOLD_MAX_BINS) return false;
+		FOR(k, c.ncand) {
+			double p_ns = (c.ncand == 1) ? c.period_ns
+				: c.period_ns - c.scan_ns + 2 * c.scan_ns * k / (c.ncand - 1);
+			double p = p_ns / 10.0 * (1 << FOLD_FRAC_BITS);
+			if(p < c.nbins or p >= 4294967296.0) return false;
+			period[k] = static_cast<uint64_t>(std::llround(p));
+			inv[k] = static_cast<uint64_t>(((unsigned __int128)1 << 64) / period[k]);
+			bin_scale[k] = ((uint64_t)c.nbins << 32) / period[k];
+		}
+		ncand = c.ncand;
+		nbins = c.nbins;
+		return true;
+	}
+	bool enabled() const { return ncand > 0; }
+
+	void reset() {
+		memset(counts, 0, sizeof(counts));
+		folded = 0;
+		t = 0;
+		skip_first = false;
+		countdown = prescale;
+	}
+
+	/* Before `reset()`. */
+	void set_prescale(uint32_t k) { prescale = k; }
+
+	/* First event after BoS: `t0` is the time of its first stamp relative to BoS, and with `skip`
+	 * the first `fill` is that stamp, its `dt` reaching back before BoS. Without, `t0` is the time
+	 * of the stamp the next `dt` counts from. */
+	void start(int64_t t0, bool skip = true) {
+		t = t0;
+		skip_first = skip;
+	}
+
+	/* One real (stamped) hit, `dt` after the previous one. */
+	inline void fill(uint32_t dt) {
+		if(dt & 0x80000000) return; // Backwards counting, see `Scaler::calc_increment`.
+		if(skip_first) skip_first = false;
+		else t += dt;
+		if(t < 0) return;
+		if(--countdown) return;
+		countdown = prescale;
+		uint64_t x = static_cast<uint64_t>(t) << FOLD_FRAC_BITS;
+		FOR(k, ncand) {
+			uint64_t q = static_cast<uint64_t>(((unsigned __int128)x * inv[k]) >> 64);
+			uint64_t r = x - q * period[k]; // q is at most one short.
+			if(r >= period[k]) r -= period[k];
+			++counts[k][(r * bin_scale[k]) >> 32];
+		}
+		++folded;
+	}
+
+	/* Epoch-folding statistic of candidate `k`: chi^2 of its phase histogram against a flat one, nbins - 1 dof. */
+	double chi2(uint32_t k) const {
+		double expected = (double)folded / nbins;
+		if(expected <= 0) return 0;
+		double s = 0;
+		FOR(b, nbins) {
+			double d = counts[k][b] - expected;
+			s += d * d;
+		}
+		return s / expected;
+	}
+
+	double period_ns(uint32_t k) const { return period[k] * 10.0 / (1 << FOLD_FRAC_BITS); }
+
+	json to_json() const {
+		json j;
+		uint32_t best = 0;
+		std::vector<double> periods, chis;
+		FOR(k, ncand) {
+			periods.push_back(period_ns(k));
+			chis.push_back(chi2(k));
+			if(chis[k] > chis[best]) best = k;
+		}
+		j["period_ns"] = periods[best];
+		j["chi2"] = chis[best];
+		j["ndf"] = nbins - 1;
+		j["folded"] = folded; // Not scaled back, so `chi2` keeps its meaning.
+		j["phase_y"] = std::vector<uint32_t>(counts[best], counts[best] + nbins);
+		if(ncand > 1) {
+			j["scan_period_ns"] = std::move(periods);
+			j["scan_chi2"] = std::move(chis);
+		}
+		return j;
+	}
+};
+
+FoldConfig fold_config;
+PhaseFold fold[4];
@@ -0,0 +1,34 @@
+/* Cross-event batching of the histogram fills, also #include'd into the main user fnc .cc file.
+ * At low occupancy an event carries only a few hits, and filling them one by one pays the
+ * call overhead of both histograms per hit. Instead, the hit kernel appends the time
+ * differences of each channel to its own array here, and they go into the micro- and
+ * macrospill histograms of the channel with `fill_batch` once HIT_BATCH_SIZE are together.
+ * `flush_all()` at EoS (and before each checkpoint) and `clear()` at BoS keep the spill
+ * boundaries exact.
+ * The first event of a channel after BoS, which splits its hits into offspill and onspill,
+ * is filled directly; its batch is empty then. */
+
+#define HIT_BATCH_SIZE 4096
+
+class HitBatch {
+public:
+	uint32_t n[4] = {0, 0, 0, 0};
+	alignas(64) uint32_t dt[4][HIT_BATCH_SIZE];
+
+	inline void push(uint32_t ch, uint32_t v) {
+		dt[ch][n[ch]++] = v;
+		if(n[ch] == HIT_BATCH_SIZE) flush(ch);
+	}
+
+	void flush(uint32_t ch) {
+		if(n[ch] == 0) return;
+		micro[ch].fill_batch(dt[ch], n[ch]);
+		Macro[ch].fill_batch(dt[ch], n[ch]);
+		n[ch] = 0;
+	}
+
+	void flush_all() { FOR(i,4) flush(i); }
+	void clear() { FOR(i,4) n[i] = 0; }
+};
+
+HitBatch hit_batch;
@@ -0,0 +1,87 @@
+/* libmicrospill, see `libmicrospill.hpp`. Mirrors `unpack_spill_data` of the unpacker,
+ * with the stamps coming as plain spans instead of UCESB lists. */
+
+#include "libmicrospill.hpp"
+
+void MicrospillEngine::configure(uint32_t ch, const ChannelConfig& c) {
+	assert(ch < MICROSPILL_CHANNELS);
+	micro[ch].name = c.name.empty() ? "ECL_IN(" + std::to_string(ch + 1) + ")" : c.name;
+	micro[ch].set_bins(c.nbins_micro);
+	micro[ch].set_range(c.max_range_micro);
+	macro[ch].bin_width = c.bin_macro;
+}
+
+void MicrospillEngine::begin_spill(uint32_t bos_ts) {
+	FOR(i, MICROSPILL_CHANNELS) {
+		micro[i].reset();
+		macro[i].init();
+		macro[i].bos_ts = bos_ts;
+	}
+}
+
+/* Skips the first batch of a channel, there is no previous stamp to take the difference to. */
+static bool prime(Scaler<31>& scaler, std::span<const uint32_t> stamps) {
+	if(!scaler.is_in_init()) return false;
+	for(uint32_t v : stamps) scaler.assign(v);
+	return true;
+}
+
+uint32_t MicrospillEngine::fill(uint32_t ch, std::span<const uint32_t> stamps, uint32_t* dt_out) {
+	assert(ch < MICROSPILL_CHANNELS);
+	MicrospillHist& h = micro[ch];
+	MacrospillHist& m = macro[ch];
+	if(stamps.empty() or prime(last_ts[ch], stamps)) return 0;
+
+	uint32_t produced = 0;
+	auto get = [&stamps](uint32_t i) { return stamps[i]; };
+	auto none = [](uint32_t) {};
+	if(m.is_first_after_bos) {
+		m.start(stamps.front());
+		unwrap_stamps(last_ts[ch], get, 0, stamps.size(), [&](uint32_t dt) {
+			if(dt_out) dt_out[produced] = dt;
+			h.fill(dt);
+			m.fill_first(dt, produced == 0);
+			++produced;
+		}, none);
+	}
+	else {
+		unwrap_stamps(last_ts[ch], get, 0, stamps.size(), [&](uint32_t dt) {
+			if(dt_out) dt_out[produced] = dt;
+			h.fill(dt);
+			m.fill(dt);
+			++produced;
+		}, none);
+	}
+	return produced;
+}
+
+uint32_t MicrospillEngine::fill_offspill(uint32_t ch, std::span<const uint32_t> stamps, uint32_t* dt_out) {
+	assert(ch < MICROSPILL_CHANNELS);
+	if(stamps.empty() or prime(last_ts[ch], stamps)) return 0;
+	uint32_t produced = 0;
+	unwrap_stamps(last_ts[ch], [&stamps](uint32_t i) { return stamps[i]; }, 0, stamps.size(),
+		[&](uint32_t dt) { if(dt_out) dt_out[produced] = dt; ++produced; },
+		[](uint32_t) {});
+	macro[ch].fill_offspill(produced);
+	return produced;
+}
+
+void MicrospillEngine::header(uint32_t ch, uint32_t clk, uint32_t ecl) {
+	assert(ch < MICROSPILL_CHANNELS);
+	MicrospillHist& h = micro[ch];
+	if(h.ecl_start == 0) {
+		h.ecl_start = ecl;
+		h.start_ts = clk;
+	}
+	h.ecl_end = ecl;
+	h.end_ts = clk;
+}
+
+void MicrospillEngine::end_spill(uint32_t eos_ts) {
+	FOR(i, MICROSPILL_CHANNELS) macro[i].eos_ts = eos_ts;
+}
+
+nlohmann::json MicrospillEngine::to_json(uint32_t ch) const {
+	assert(ch < MICROSPILL_CHANNELS);
+	return convert_to_json(micro[ch], macro[ch]);
+}
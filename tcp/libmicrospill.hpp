@@ -0,0 +1,60 @@
+#pragma once
+/* libmicrospill: the micro- and macrospill histogramming of the unpacker, without UCESB.
+ * Build with `make tcp/libmicrospill.a`, link with `-Ltcp -lmicrospill`.
+ * Feed it the raw 31-bit stamps of each channel (32nd bit = lost-hit marker), in batches
+ * of whatever size the readout delivers, between `begin_spill` and `end_spill`:
+ *
+ *   MicrospillEngine e;
+ *   e.configure(0, {.name = "S2", .nbins_micro = 200});
+ *   e.begin_spill(bos_clk);
+ *   e.header(ch, clk, ecl);               // Per readout, any channel ..
+ *   e.fill(ch, std::span(stamps, n));     // .. with its stamps.
+ *   e.end_spill(eos_clk);
+ *   json j = e.to_json(ch);               // Same layout as `j["data"][i]` of the unpacker.
+ *
+ * The stamps and BoS/EoS times are in 10 ns ticks of the same (VULOM) clock.
+ * Not thread-safe, use one engine per thread. */
+
+#include <span>
+#include "microspill.hpp"
+
+#define MICROSPILL_CHANNELS 4
+
+struct ChannelConfig {
+	std::string name;
+	uint32_t nbins_micro = DEFAULT_BINS_MICRO;
+	uint32_t max_range_micro = MAX_RANGE_MICRO_DEFAULT; // [10 ns]
+	double bin_macro = DEFAULT_BIN_MACRO;               // [s]
+};
+
+class MicrospillEngine {
+public:
+	MicrospillHist micro[MICROSPILL_CHANNELS];
+	MacrospillHist macro[MICROSPILL_CHANNELS];
+	Scaler<31> last_ts[MICROSPILL_CHANNELS];
+
+	/* Takes effect right away, call it between spills. */
+	void configure(uint32_t ch, const ChannelConfig& c);
+
+	void begin_spill(uint32_t bos_ts);
+
+	/* Histograms one batch of stamps of channel `ch`, in time order. Optionally writes
+	 * the time differences into `dt_out`, which must hold 2 per stamp.
+	 * The very first batch of a channel only primes its unwrapping.
+	 * Returns the number of hits, i.e. time differences. */
+	uint32_t fill(uint32_t ch, std::span<const uint32_t> stamps, uint32_t* dt_out = nullptr);
+
+	/* Same, outside of the spill: only counts the hits as offspill. */
+	uint32_t fill_offspill(uint32_t ch, std::span<const uint32_t> stamps, uint32_t* dt_out = nullptr);
+
+	/* Optional, per readout within the spill: the 32-bit VULOM clock and ECL_IN(x) counter
+	 * of the readout header. Without them `elapsed_time_10ns`, `lost_hits` and the Poisson
+	 * prediction are meaningless. */
+	void header(uint32_t ch, uint32_t clk, uint32_t ecl);
+
+	/* `eos_ts` closes the macrospill histograms. Until the next `begin_spill`,
+	 * the spill can be read out of `micro`/`macro` or with `to_json`. */
+	void end_spill(uint32_t eos_ts);
+
+	nlohmann::json to_json(uint32_t ch) const;
+};
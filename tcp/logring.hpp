@@ -0,0 +1,184 @@
+/* Non-blocking diagnostics for the hot path, also #include'd into the main user fnc .cc file.
+ * `LOG_YELL` / `LOG_WARN` take the same arguments as `YELL` / `WARN`, but format into a slot
+ * of a bounded lock-free ring and return; a background thread writes the ring out to stderr.
+ * The ring has several producers (the JSON conversion runs in std::async threads), and a
+ * producer never waits: if the ring is full, the message is dropped and counted.
+ * Each call site lets through at most LOG_SITE_RATE messages per second. The rest are only
+ * counted, and the count is printed with the next message of the site that gets through. */
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <time.h>
+
+#define LOG_RING_SIZE 1024 // Must be a power of 2.
+#define LOG_MSG_LEN 200
+#define LOG_SITE_RATE 10
+#define LOG_DRAIN_MS 20
+#define LOG_STATS_KEEP 32  // Lines kept for the `stats` topic, per spill.
+
+struct LogSite {
+	std::atomic<uint32_t> second{0};
+	std::atomic<uint32_t> count{0};
+	std::atomic<uint32_t> suppressed{0};
+
+	/* True if the message can go out. Concurrent callers can race on the
+	 * second boundary, at worst letting a few extra messages through. */
+	inline bool admit(uint32_t& n_suppressed) noexcept {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		uint32_t now = ts.tv_sec;
+		if(second.load(std::memory_order_relaxed) != now) {
+			second.store(now, std::memory_order_relaxed);
+			count.store(0, std::memory_order_relaxed);
+		}
+		if(count.fetch_add(1, std::memory_order_relaxed) >= LOG_SITE_RATE) {
+			suppressed.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		n_suppressed = suppressed.exchange(0, std::memory_order_relaxed);
+		return true;
+	}
+	/* The admitted message didn't make it into the ring, its suppressed count goes on to the next one. */
+	inline void give_back(uint32_t n_suppressed) noexcept {
+		if(n_suppressed) suppressed.fetch_add(n_suppressed, std::memory_order_relaxed);
+	}
+};
+
+struct LogSlot {
+	std::atomic<uint32_t> seq;
+	bool yell;
+	const char* file;
+	int line;
+	uint32_t suppressed;
+	char text[LOG_MSG_LEN];
+};
+
+/* Bounded MPSC ring, each slot carries the sequence number it expects next:
+ * `pos` when free for the producer at `pos`, `pos + 1` when filled. */
+class LogRing {
+	static constexpr uint32_t mask = LOG_RING_SIZE - 1;
+	static_assert((LOG_RING_SIZE & mask) == 0, "LOG_RING_SIZE must be a power of 2.");
+
+	LogSlot slots[LOG_RING_SIZE];
+	alignas(64) std::atomic<uint32_t> head{0};
+	alignas(64) uint32_t tail = 0;     // Drain thread only.
+	std::atomic<uint32_t> dropped{0};
+
+	std::thread worker;
+	std::atomic<bool> stop_flag{false};
+
+	bool keep_recent = false;
+	std::mutex recent_mtx;
+	std::vector<std::string> recent;   // Guarded by `recent_mtx`.
+	uint32_t recent_overflow = 0;      // Guarded by `recent_mtx`.
+
+	void write_out(const LogSlot& s) {
+		fprintf(stderr, KGRN "%s" KNRM ":" KCYN "%d" KNRM " => ", s.file, s.line);
+		if(s.yell) fprintf(stderr, KBH_RED "%s" KNRM, s.text);
+		else fputs(s.text, stderr);
+		if(s.suppressed) fprintf(stderr, "   .. %u more like it suppressed.\n", s.suppressed);
+		if(!keep_recent) return;
+
+		std::lock_guard<std::mutex> lock(recent_mtx);
+		if(recent.size() < LOG_STATS_KEEP) {
+			std::string line = std::string(s.file) + ":" + std::to_string(s.line) + " " + s.text;
+			while(!line.empty() and line.back() == '\n') line.pop_back();
+			if(s.suppressed) line += " (" + std::to_string(s.suppressed) + " more suppressed)";
+			recent.push_back(std::move(line));
+		}
+		else ++recent_overflow;
+	}
+
+	uint32_t drain() {
+		uint32_t n = 0;
+		for(;;) {
+			LogSlot& s = slots[tail & mask];
+			if(s.seq.load(std::memory_order_acquire) != tail + 1) break;
+			write_out(s);
+			s.seq.store(tail + LOG_RING_SIZE, std::memory_order_release);
+			++tail; ++n;
+		}
+		return n;
+	}
+
+	void loop() {
+		while(!stop_flag.load(std::memory_order_relaxed)) {
+			if(drain() == 0) std::this_thread::sleep_for(std::chrono::milliseconds(LOG_DRAIN_MS));
+		}
+		drain();
+	}
+
+public:
+	LogRing() { FOR(i, LOG_RING_SIZE) slots[i].seq.store(i, std::memory_order_relaxed); }
+	~LogRing() { stop(); }
+
+	/* Producer side, returns nullptr if the ring is full. */
+	inline LogSlot* reserve(uint32_t& pos) noexcept {
+		pos = head.load(std::memory_order_relaxed);
+		for(;;) {
+			LogSlot* s = &slots[pos & mask];
+			int32_t diff = (int32_t)(s->seq.load(std::memory_order_acquire) - pos);
+			if(diff == 0) {
+				if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return s;
+			}
+			else if(diff < 0) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return nullptr;
+			}
+			else pos = head.load(std::memory_order_relaxed);
+		}
+	}
+	inline void commit(LogSlot* s, uint32_t pos) noexcept {
+		s->seq.store(pos + 1, std::memory_order_release);
+	}
+
+	/* `keep` also collects the lines for `take_recent`. */
+	void start(bool keep) {
+		keep_recent = keep;
+		worker = std::thread(&LogRing::loop, this);
+	}
+
+	void stop() {
+		if(!worker.joinable()) return;
+		stop_flag = true;
+		worker.join();
+		uint32_t n = dropped.load(std::memory_order_relaxed);
+		if(n) WARN("%u diagnostic messages dropped, the log ring was full.\n", n);
+	}
+
+	/* Lines written out since the last call, for the `stats` topic. */
+	json take_recent() {
+		json j;
+		std::lock_guard<std::mutex> lock(recent_mtx);
+		j["lines"] = std::move(recent);
+		j["overflow"] = recent_overflow;
+		j["dropped"] = dropped.load(std::memory_order_relaxed);
+		recent.clear();
+		recent_overflow = 0;
+		return j;
+	}
+};
+
+LogRing logring;
+
+#define LOG_MSG(is_yell, ...) \
+	do { \
+		static LogSite _log_site; \
+		uint32_t _log_supp; \
+		if(_log_site.admit(_log_supp)) { \
+			uint32_t _log_pos; \
+			if(LogSlot* _log_s = logring.reserve(_log_pos)) { \
+				_log_s->yell = is_yell; \
+				_log_s->file = __FILENAME__; \
+				_log_s->line = __LINE__; \
+				_log_s->suppressed = _log_supp; \
+				snprintf(_log_s->text, LOG_MSG_LEN, __VA_ARGS__); \
+				logring.commit(_log_s, _log_pos); \
+			} \
+			else _log_site.give_back(_log_supp); \
+		} \
+	} while(0)
+#define LOG_YELL(...) LOG_MSG(true, __VA_ARGS__)
+#define LOG_WARN(...) LOG_MSG(false, __VA_ARGS__)
@@ -1,5 +1,27 @@
-/* This will will just get #include'd into the main user fnc .cc file.
- * All the relevant library include's will be on top of that file. */
+#pragma once
+/* The histogramming engine: #include'd into the main user fnc .cc file, and the core of libmicrospill
+ * (`tcp/libmicrospill.hpp`), so it only depends on the standard library, nlohmann json and `Scaler`. */
+
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+#include <array>
+#include <vector>
+#include <tuple>
+#include <string>
+#include <numeric>
+#include <algorithm>
+#include <utility>
+#include "nlohmann/json.hpp"
+#include "scaler.hpp"
+
+#ifndef DEFAULT_BINS_MICRO
+#define DEFAULT_BINS_MICRO 100
+#endif
+#ifndef DEFAULT_BIN_MACRO
+#define DEFAULT_BIN_MACRO 0.1
+#endif
 
 constexpr double epsilon = 0.3010299956639812;
 
@@ -21,6 +43,8 @@ inline int ffloor(double x) noexcept {
 #define MAX_BINS_MICRO 256
 #define MAX_RANGE_MICRO_DEFAULT 10'000'000 // Given in units of 10 ns ==> 100 ms = 0.1s, everything above that is overflow.
 #define MIN_RANGE_MICRO_DEFAULT 1          // This is true zero in log scale (x axis).
+#define FINE_BINS_MICRO 1024               // Underlying histogram of the adaptive binning.
+#define FILL_CHUNK 256                     // Hits per pass of `fill_batch`.
 /* Note: bin[0] shall ALWAYS start at 10 ns. Users can only change the maximum range of the scale. */
 
 class MicrospillHist {
@@ -33,6 +57,7 @@ public:
 
 	uint32_t nbins = DEFAULT_BINS_MICRO;
 	double max_range_log;
+	double log_scale; // nbins / max_range_log
 	uint32_t cutoff_index;
 
 	std::string name;
@@ -41,6 +66,14 @@ public:
 	uint32_t overflows = 0;
 	uint32_t arr[MAX_BINS_MICRO] = {0};
 
+	/* Same range in FINE_BINS_MICRO bins, only filled with `fine_scale` != 0, see `tcp/adaptive.hpp`. */
+	double fine_scale = 0;
+	uint32_t fine[FINE_BINS_MICRO] = {0};
+
+	/* Only every `prescale`-th hit is filled, see `tcp/shed.hpp`. */
+	uint32_t prescale = 1;
+	uint32_t countdown = 1;
+
 	uint32_t ecl_start, ecl_end; // values recorded at first hit/last hit in the spill.
 	uint32_t start_ts, end_ts;   // from VULOM's clock, last hit and first hit in the spill.
 	uint64_t spill_ts;           // from Whiterabbit, potentially.
@@ -50,6 +83,7 @@ public:
 		start_ts(0), end_ts(0)
 	{
 		max_range_log = log10(max_range);
+		log_scale = nbins / max_range_log;
 		set_cutoff();
 	}
 	
@@ -57,29 +91,77 @@ public:
 		assert(max_range > 100);
 		this->max_range = max_range;
 		max_range_log = log10(max_range);
+		log_scale = nbins / max_range_log;
+		if(fine_scale != 0) fine_scale = FINE_BINS_MICRO / max_range_log;
 		set_cutoff();
 	}
 
+	void enable_fine(bool on) {
+		fine_scale = on ? FINE_BINS_MICRO / max_range_log : 0;
+	}
+
+	uint32_t get_range() const { return max_range; }
+
 	void set_bins(uint32_t nbins) {
 		assert(nbins > 5 and nbins <= MAX_BINS_MICRO);
 		this->nbins = nbins;
+		log_scale = nbins / max_range_log;
 		set_cutoff();
 	}
 
-	uint32_t fill(unpack_event *event) {
-		nil<1024>* delta_t = &event->trloii_mvlc.dt;
-		uint32_t nitems = delta_t->_num_items;
-		FOR(i, nitems) {
-			uint32_t bin = static_cast<uint32_t>(nbins / max_range_log * log10(delta_t->_items[i].value));
-			if(bin >= nbins) { ++overflows; --hits_counted; }
-			else ++arr[bin];
+	inline void fill(uint32_t dt) {
+		if(--countdown) return;
+		countdown = prescale;
+		double l = log10(dt);
+		uint32_t bin = static_cast<uint32_t>(log_scale * l);
+		if(bin >= nbins) { ++overflows; }
+		else { ++arr[bin]; ++hits_counted; }
+		if(fine_scale != 0) {
+			uint32_t f = static_cast<uint32_t>(fine_scale * l);
+			if(f < FINE_BINS_MICRO) ++fine[f];
 		}
-		hits_counted += nitems;
-		return nitems;
+	}
+
+	/* Same as `fill` on each of `dt[0]` .. `dt[n - 1]`, in chunks: the logarithms of a chunk
+	 * are taken in a loop of their own, free of the data-dependent counting. */
+	void fill_batch(const uint32_t* dt, uint32_t n) {
+		uint32_t first = countdown - 1; // Next hit to be filled.
+		if(first >= n) { countdown -= n; return; }
+		uint32_t last = first + (n - 1 - first) / prescale * prescale;
+		countdown = prescale - (n - 1 - last);
+
+		double l[FILL_CHUNK];
+		for(uint32_t i = first; i <= last;) {
+			uint32_t m = 0;
+			for(; m < FILL_CHUNK and i <= last; ++m, i += prescale) l[m] = log10(dt[i]);
+			FOR(k, m) {
+				uint32_t bin = static_cast<uint32_t>(log_scale * l[k]);
+				if(bin >= nbins) { ++overflows; }
+				else { ++arr[bin]; ++hits_counted; }
+			}
+			if(fine_scale != 0) FOR(k, m) {
+				uint32_t f = static_cast<uint32_t>(fine_scale * l[k]);
+				if(f < FINE_BINS_MICRO) ++fine[f];
+			}
+		}
+	}
+
+	void set_prescale(uint32_t k) {
+		prescale = k;
+		countdown = k;
+	}
+
+	/* Estimate of all the hits, at EoS. `fine` stays as filled, see `adaptive_to_json`. */
+	void scale_up() {
+		if(prescale == 1) return;
+		FOR(i, nbins) arr[i] *= prescale;
+		hits_counted *= prescale;
+		overflows *= prescale;
 	}
 
 	void reset() {
-		memset(arr, 0, sizeof(*arr) * nbins);
+		memset(arr, 0, sizeof(arr)); // All of it, `nbins` may have changed since the last fill.
+		if(fine_scale != 0) memset(fine, 0, sizeof(fine));
 		overflows = 0; hits_counted = 0;
 		ecl_start = 0; start_ts = 0;
 	}
@@ -113,7 +195,7 @@ private:
 /* Array size depends on the splice parameters, `left_i`, `right_i`, as such this function
  * cannot return an array, and must return a vector. 
  * `inds` is the vector of indices. */
-std::vector<double> poisson_log_expected(std::vector<uint32_t> inds,
+inline std::vector<double> poisson_log_expected(std::vector<uint32_t> inds,
 const uint32_t N0, const int32_t T_total, const uint32_t nbins, const double M) noexcept {
 	const double f = N0 / (double)T_total;
 	const double C = M / nbins;
@@ -170,7 +252,7 @@ using TicksTuple = std::tuple<
 >;
 
 // `xs` is already sorted.
-TicksTuple GetXTicks(const std::vector<double>& xs) {
+inline TicksTuple GetXTicks(const std::vector<double>& xs) {
 	const int minx = ffloor(xs.front());
 	const int maxx = cceil(xs.back());
 	std::vector<double> major_ticks(maxx - minx + 1);
@@ -199,7 +281,7 @@ TicksTuple GetXTicks(const std::vector<double>& xs) {
 	);
 }
 
-TicksTuple GetYTicks(const std::vector<double>& ys) {
+inline TicksTuple GetYTicks(const std::vector<double>& ys) {
 	const int minx = 0;
 	const double max_value = *std::max_element(ys.begin(), ys.end());
 	const int maxx = ffloor(max_value * 1.08);
@@ -260,56 +342,40 @@ public:
 		time_in_spill = 0.0;
 		is_first_after_bos = true;
 	}
-#if 0
-	void fill(unpack_event *event) {
-		nil<1024>* delta_t = &event->trloii_mvlc.dt;
-		uint32_t nitems = delta_t->_num_items;
-		FOR(i, nitems) {
-			time_in_spill += delta_t->_items[i].value / 1e8;
-			int bin = std::min(static_cast<int>(time_in_spill/bin_width), MAX_BINS_MACRO);
+	/* Time t=0 is begining-of-spill. Don't rely on `delta_t` between hits,
+	 * Initially, get time difference from absolute stamp relative to BoS stamp.
+	 * `init_ts` is the first stamp of the first event after BoS. Only mind that
+	 * it's 31-bit stamp. */
+	void start(uint32_t init_ts) {
+		time_in_spill = Scaler<31>::calc_diff(init_ts, bos_ts) / 1e8; // Can be negative.
+		is_first_after_bos = false;
+	}
+
+	inline void fill(uint32_t dt) {
+		time_in_spill += dt / 1e8;
+		int bin = std::min(static_cast<int>(time_in_spill/bin_width), MAX_BINS_MACRO);
+		++arr[bin];
+	}
+	inline void fill_batch(const uint32_t* dt, uint32_t n) {
+		double t = time_in_spill;
+		FOR(i, n) {
+			t += dt[i] / 1e8;
+			int bin = std::min(static_cast<int>(t/bin_width), MAX_BINS_MACRO);
 			++arr[bin];
 		}
+		time_in_spill = t;
 	}
-#endif
-	void fill(unpack_event *event) {
-		nil<1024>* delta_t = &event->trloii_mvlc.dt;
-		uint32_t nitems = delta_t->_num_items;
-		if(is_first_after_bos) {	
-			/* Time t=0 is begining-of-spill. Don't rely on `delta_t` between hits,
-			 * Initially, get time difference from absolute stamp relative to BoS stamp.
-			 * Abusing the fact that timing list is sorted in time. Only mind that
-			 * it's 31-bit stamp. */
-
-			uint32_t init_ts;
-			nil<1024>* timing = &event->trloii_mvlc.spill_extra.timing;
-			if(timing->_num_items > 0) {
-				init_ts = timing->_items[0].value;
-			} else if(((timing = &event->trloii_mvlc.spill.timing) and timing->_num_items > 0)) {
-				init_ts = timing->_items[0].value;
-			} else return;
-
-			time_in_spill = Scaler<31>::calc_diff(init_ts, bos_ts) / 1e8; // Can be negative.
-			nil<1024>* delta_t = &event->trloii_mvlc.dt;
-			uint32_t nitems = delta_t->_num_items;
-			for(uint32_t i=0; i < nitems; ++i) {
-				if(i>0) time_in_spill += delta_t->_items[i].value / 1e8;
-				if(time_in_spill < 0) { ++offspill; continue; }
-				int bin = std::min(static_cast<int>(time_in_spill/bin_width), MAX_BINS_MACRO);
-				++arr[bin];
-			}
-			is_first_after_bos = false;
-		}
-		else {
-			FOR(i, nitems) {
-				time_in_spill += delta_t->_items[i].value / 1e8;
-				int bin = std::min(static_cast<int>(time_in_spill/bin_width), MAX_BINS_MACRO);
-				++arr[bin];
-			}
-		}
+	/* Within the first event after BoS: `time_in_spill` of its first hit is already
+	 * set by `start()`, and hits before BoS are offspill. Returns false for those. */
+	inline bool fill_first(uint32_t dt, bool is_first_hit) {
+		if(!is_first_hit) time_in_spill += dt / 1e8;
+		if(time_in_spill < 0) { ++offspill; return false; }
+		int bin = std::min(static_cast<int>(time_in_spill/bin_width), MAX_BINS_MACRO);
+		++arr[bin];
+		return true;
 	}
-	void fill_offspill(unpack_event *event) {
-		nil<1024>* delta_t = &event->trloii_mvlc.dt;
-		offspill += delta_t->_num_items;
+	void fill_offspill(uint32_t nhits) {
+		offspill += nhits;
 	}
 
 	using XYPair = std::pair<std::vector<double>, std::vector<int>>;
@@ -338,13 +404,33 @@ public:
 	}
 };
 
-MicrospillHist micro[4];
-MacrospillHist Macro[4];
-
-struct timespec sys_ts;
+/* Unwraps the raw 31-bit stamps `get(from)` .. `get(to - 1)` of one channel into time differences.
+ * `emit(dt)` is called per hit: a stamp with the lost-hit marker (32nd bit) stands for two hits,
+ * each given half the difference. `stamped(dt)` is then called once per stamp, with the full one. */
+template<typename Get, typename Emit, typename Stamped>
+inline void unwrap_stamps(Scaler<31>& scaler, Get&& get, uint32_t from, uint32_t to, Emit&& emit, Stamped&& stamped) {
+	for(uint32_t i = from; i < to; ++i) {
+		uint32_t val = get(i);
+		scaler.assign(val);
+		uint32_t dt = scaler.calc_increment();
+		/* 32nd bit is error marker. 
+		 * Means one or more hits between `valid` items got simply lost. 
+		 * This doesn't happen until ~2.5 MHz (in one channel). */
+		if(val & 0x80000000) {
+			/* One hit in between has been lost for sure. 
+			 * Try to fake it by supposing it's right in the middle of them. */
+			emit(dt / 2);
+			emit(dt / 2);
+		}
+		else { /* No hits lost. */
+			emit(dt);
+		}
+		stamped(dt);
+	}
+}
 
 /* Convert the accumulated hist data into JSON that the TCP will send. */
-json convert_to_json(const MicrospillHist& hist, const MacrospillHist& macro) {
+inline nlohmann::json convert_to_json(const MicrospillHist& hist, const MacrospillHist& macro) {
 	auto [left_i, right_i] = hist.get_bounds();
 	assert(left_i > 0 and right_i <= (int)hist.nbins-1);
 
@@ -379,7 +465,7 @@ json convert_to_json(const MicrospillHist& hist, const MacrospillHist& macro) {
 	auto [xticks_major, xticks_major_label, xticks_minor] = GetXTicks(xs); 
 	auto [yticks_major, yticks_major_label, yticks_minor] = GetYTicks(ys); 
 
-	json j;
+	nlohmann::json j;
 	j["name"] = hist.name;
 	j["counted"] = hist.hits_counted;
 	j["lost_hits"] = abs(hist.hits_counted - Scaler<>::calc_diff(hist.ecl_end, hist.ecl_start));
@@ -405,7 +491,7 @@ json convert_to_json(const MicrospillHist& hist, const MacrospillHist& macro) {
 	return j;
 }
 
-void timestamp_to_string(uint64_t ts, char* buffer, size_t count=28) {
+inline void timestamp_to_string(uint64_t ts, char* buffer, size_t count=28) {
 	time_t ts_s = ts / 1000000000;
 	int cs = (int)((ts / 10000000) % 100);
 	struct tm *tm_time = localtime(&ts_s);
@@ -0,0 +1,172 @@
+/* Online spill-quality statistics, also #include'd into the main user fnc .cc file.
+ * `SpillQuality` is filled per hit by the hit kernel, in O(1). At EoS the metrics
+ * are compared against a rolling baseline of the previous spills. */
+
+#define MAX_BASELINE_SPILLS 256
+#define MIN_BASELINE_SPILLS 5
+#define MIN_QUALITY_HITS 100
+
+class SpillQuality {
+public:
+	uint32_t window = DEFAULT_QUALITY_WINDOW;
+
+	bool started;
+
+	/* Moments of the time differences. */
+	uint64_t n_dt;
+	double sum_dt, sum_dt2;
+
+	/* Moments of the hit counts in consecutive `window`s, time t=0 at the first hit. */
+	uint64_t t;
+	uint64_t window_end;
+	uint32_t window_count;
+	uint64_t n_windows;
+	double sum_c, sum_c2;
+
+	SpillQuality() { reset(); }
+
+	void reset() {
+		started = false;
+		n_dt = 0; sum_dt = 0; sum_dt2 = 0;
+		t = 0; window_end = window; window_count = 0;
+		n_windows = 0; sum_c = 0; sum_c2 = 0;
+	}
+
+	/* The first hit of the spill only sets t=0, its `dt` reaches back before BoS. */
+	inline void fill(uint32_t dt) {
+		if(dt & 0x80000000) return; // Backwards counting, see `Scaler::calc_increment`.
+		if(!started) { started = true; ++window_count; return; }
+		++n_dt;
+		sum_dt += dt;
+		sum_dt2 += static_cast<double>(dt) * dt;
+		t += dt;
+		if(t >= window_end) close_windows();
+		++window_count;
+	}
+private:
+	/* Close the running window and all the empty ones up to `t`. The last, partial
+	 * window of the spill is never closed. */
+	void close_windows() {
+		sum_c += window_count;
+		sum_c2 += static_cast<double>(window_count) * window_count;
+		uint64_t skipped = (t - window_end) / window;
+		n_windows += 1 + skipped;
+		window_end += (1 + skipped) * window;
+		window_count = 0;
+	}
+};
+
+struct QualityMetrics {
+	bool valid = false;
+	uint32_t hits = 0;
+	double duty_factor = NAN;   // <N>^2 / <N^2> of the window counts. 1 = perfectly flat.
+	double fano_factor = NAN;   // Var(N) / <N> of the window counts. 1 = Poisson.
+	double cv_dt = NAN;         // Std(dt) / <dt>. 1 = Poisson.
+	double peak_to_mean = NAN;  // Of the macrospill rate.
+	double lost_fraction = NAN; // Lost hits over the ECL_IN(x) scaler counts.
+};
+
+/* Which way each metric goes when the extraction degrades, and the smallest deviation that counts. */
+constexpr struct {
+	const char* key;
+	double QualityMetrics::*field;
+	int bad_sign;
+	double abs_floor;
+} quality_fields[] = {
+	{"duty_factor",   &QualityMetrics::duty_factor,   -1, 0.01},
+	{"fano_factor",   &QualityMetrics::fano_factor,   +1, 0.05},
+	{"cv_dt",         &QualityMetrics::cv_dt,         +1, 0.01},
+	{"peak_to_mean",  &QualityMetrics::peak_to_mean,  +1, 0.05},
+	{"lost_fraction", &QualityMetrics::lost_fraction, +1, 0.001},
+};
+#define QUALITY_REL_FLOOR 0.05
+
+QualityMetrics compute_quality(const SpillQuality& q, const MicrospillHist& hist, const MacrospillHist& macro) {
+	QualityMetrics m;
+	m.hits = q.n_dt;
+	if(q.n_dt < MIN_QUALITY_HITS or q.n_windows < 2) return m;
+	m.valid = true;
+
+	double mean_c = q.sum_c / q.n_windows;
+	double mean_c2 = q.sum_c2 / q.n_windows;
+	m.duty_factor = mean_c * mean_c / mean_c2;
+	m.fano_factor = (mean_c2 - mean_c * mean_c) / mean_c;
+
+	double mean_dt = q.sum_dt / q.n_dt;
+	double var_dt = q.sum_dt2 / q.n_dt - mean_dt * mean_dt;
+	m.cv_dt = std::sqrt(std::max(var_dt, 0.0)) / mean_dt;
+
+	auto [_x, ys] = macro.get_xy();
+	if(!ys.empty()) {
+		double mean_y = std::accumulate(ys.begin(), ys.end(), 0.0) / ys.size();
+		if(mean_y > 0) m.peak_to_mean = *std::max_element(ys.begin(), ys.end()) / mean_y;
+	}
+
+	int32_t scaled = Scaler<>::calc_diff(hist.ecl_end, hist.ecl_start);
+	if(scaled > 0) m.lost_fraction = abs(hist.hits_counted - scaled) / (double)scaled;
+	return m;
+}
+
+/* Rolling window of the last `nspills` valid metrics of one channel. */
+class QualityBaseline {
+	QualityMetrics ring[MAX_BASELINE_SPILLS];
+	uint32_t head = 0;
+	uint32_t count = 0;
+public:
+	uint32_t nspills = DEFAULT_BASELINE_SPILLS;
+
+	void push(const QualityMetrics& m) {
+		if(!m.valid) return;
+		ring[head] = m;
+		head = (head + 1) % nspills;
+		if(count < nspills) ++count;
+	}
+
+	/* Appends an alarm object to `alarms` for each metric of `m` that deviates
+	 * from the baseline in the bad direction by more than `nsigma`. */
+	void check(const QualityMetrics& m, double nsigma, int channel, const std::string& name, json& alarms) const {
+		if(!m.valid or count < MIN_BASELINE_SPILLS) return;
+		for(const auto& f : quality_fields) {
+			double x = m.*(f.field);
+			if(std::isnan(x)) continue;
+			double sum = 0, sum2 = 0;
+			uint32_t n = 0;
+			FOR(i, count) {
+				double v = ring[i].*(f.field);
+				if(std::isnan(v)) continue;
+				sum += v; sum2 += v * v; ++n;
+			}
+			if(n < MIN_BASELINE_SPILLS) continue;
+			double mean = sum / n;
+			double sigma = std::sqrt(std::max(sum2 / n - mean * mean, 0.0));
+			sigma = std::max({sigma, QUALITY_REL_FLOOR * std::abs(mean), f.abs_floor});
+			double z = (x - mean) / sigma;
+			if(z * f.bad_sign > nsigma) {
+				alarms.push_back({
+					{"channel", channel + 1},
+					{"name", name},
+					{"metric", f.key},
+					{"value", x},
+					{"baseline", mean},
+					{"sigma", sigma},
+					{"deviation", z}
+				});
+			}
+		}
+	}
+};
+
+SpillQuality quality[4];
+QualityBaseline baseline[4];
+
+json quality_to_json(const QualityMetrics& m, const std::string& name) {
+	json j;
+	j["name"] = name;
+	j["hits"] = m.hits;
+	for(const auto& f : quality_fields) {
+		double x = m.*(f.field);
+		if(std::isnan(x)) j[f.key] = nullptr;
+		else j[f.key] = x;
+	}
+	return j;
+}
@@ -0,0 +1,186 @@
+/* Runtime reconfiguration over a ZMQ request/reply socket, also #include'd into the main user fnc .cc file.
+ * A background thread validates each request against a staged copy of `g_config`, keeps it
+ * and acknowledges it. The unpacker thread only looks at an atomic sequence number at BoS, and
+ * when it changed applies the kept requests onto `g_config` (under the lock, which is never
+ * touched while filling), so only the keys they set change.
+ *
+ * Request:  {"cmd": "set", "nbins_micro": 120, "max_range_micro": [null, 5000000, null, null],
+ *            "bin_macro": 0.2, "alias": {"2": "SCI21"}, "publish": {"json": true, "alarm": false}}
+ *           Per-channel keys take a number for all four channels, or an array of four (null = keep).
+ *           {"cmd": "get"} returns the staged and the applied configuration.
+ *           {"cmd": "trend", "metric": "counted", "channel": 1, "from": T0, "until": T1, "points": 800}
+ *           returns the long-term series of a per-spill scalar, see `tcp/trend.hpp`.
+ * Reply:    {"status": "ok", "seq": N, "applied_seq": M} or {"status": "error", "error": "..."}.
+ *           The change with sequence N takes effect at the first BoS after it is acknowledged. */
+
+#include <mutex>
+#include <atomic>
+
+#define CONTROL_POLL_MS 200
+
+class ControlServer {
+	std::thread worker;
+	std::atomic<bool> stop_flag{false};
+	std::mutex mtx;
+	g_config_t staged;                 // `applied` with the pending requests, for "get". Guarded by `mtx`.
+	g_config_t applied;                // Guarded by `mtx`.
+	std::vector<json> pending_reqs;    // Validated, not yet applied. Guarded by `mtx`.
+	std::atomic<uint32_t> staged_seq{0};
+	uint32_t applied_seq = 0;          // Unpacker thread only.
+	std::atomic<uint32_t> applied_seq_shared{0};
+
+	/* Per-channel setting: a single value for all channels, or an array of four. */
+	template<typename T, typename Check>
+	static void set_channels(const json& j, T (&dest)[4], Check&& check, const char* key) {
+		T vals[4];
+		FOR(i,4) vals[i] = dest[i];
+		if(j.is_array()) {
+			if(j.size() != 4) throw std::invalid_argument(std::string(key) + ": expected 4 values");
+			FOR(i,4) if(!j[i].is_null()) vals[i] = j[i].get<T>();
+		}
+		else vals[0] = vals[1] = vals[2] = vals[3] = j.get<T>();
+		FOR(i,4) if(!check(vals[i])) throw std::out_of_range(std::string(key) + ": value out of range");
+		FOR(i,4) dest[i] = vals[i];
+	}
+
+	/* Validate the request into a copy, so a bad request leaves `staged` untouched. */
+	static g_config_t parse_set(const json& req, const g_config_t& from) {
+		g_config_t c = from;
+		for(auto& [key, val] : req.items()) {
+			if(key == "cmd") continue;
+			else if(key == "nbins_micro")
+				set_channels(val, c.nbins_micro, [](int v) { return v > 5 and v <= MAX_BINS_MICRO; }, "nbins_micro");
+			else if(key == "max_range_micro")
+				set_channels(val, c.max_range_micro, [](int v) { return v == -1 or v > 100; }, "max_range_micro");
+			else if(key == "bin_macro")
+				set_channels(val, c.acc_period_macro, [](double v) { return v >= 0.05 and v < 2.0; }, "bin_macro");
+			else if(key == "alias") {
+				for(auto& [ch, name] : val.items()) {
+					if(ch.size() != 1 or ch[0] < '1' or ch[0] > '4') throw std::out_of_range("alias: channel must be 1-4");
+					c.name[ch[0] - '1'] = name.get<std::string>();
+				}
+			}
+			else if(key == "publish") {
+				for(auto& [what, on] : val.items()) {
+					if(what == "json") {
+						if(on.get<bool>() and pub == nullptr)
+							throw std::invalid_argument("publish: JSON socket not bound, start with --json");
+						c.publish_json = on.get<bool>();
+					}
+					else if(what == "alarm") {
+						if(on.get<bool>() and pub_quality == nullptr)
+							throw std::invalid_argument("publish: alarm socket not bound, start with --alarm");
+						c.publish_quality = on.get<bool>();
+					}
+					else throw std::invalid_argument("publish: unknown option " + what);
+				}
+			}
+			else if(key == "alarm_sigma") {
+				double v = val.get<double>();
+				if(v <= 0) throw std::out_of_range("alarm_sigma: must be > 0");
+				c.alarm_sigma = v;
+			}
+			else throw std::invalid_argument("unknown key " + key);
+		}
+		return c;
+	}
+
+	static json config_to_json(const g_config_t& c) {
+		json j;
+		j["alias"] = c.name;
+		j["nbins_micro"] = c.nbins_micro;
+		j["max_range_micro"] = c.max_range_micro;
+		j["bin_macro"] = c.acc_period_macro;
+		j["publish"] = {{"json", c.publish_json}, {"alarm", c.publish_quality}};
+		j["alarm_sigma"] = c.alarm_sigma;
+		return j;
+	}
+
+	std::string handle(const std::string& msg) {
+		json reply;
+		try {
+			json req = json::parse(msg);
+			std::string cmd = req.value("cmd", "set");
+			if(cmd == "trend") {
+				reply = trend.query(req);
+				reply["status"] = "ok";
+				return reply.dump();
+			}
+			std::lock_guard<std::mutex> lock(mtx);
+			if(cmd == "set") {
+				staged = parse_set(req, staged);
+				pending_reqs.push_back(std::move(req));
+				reply["seq"] = staged_seq.fetch_add(1, std::memory_order_release) + 1;
+			}
+			else if(cmd == "get") {
+				reply["staged"] = config_to_json(staged);
+				reply["applied"] = config_to_json(applied);
+				reply["seq"] = staged_seq.load(std::memory_order_relaxed);
+			}
+			else throw std::invalid_argument("unknown cmd " + cmd);
+			reply["status"] = "ok";
+			reply["applied_seq"] = applied_seq_shared.load(std::memory_order_relaxed);
+		}
+		catch(std::exception& e) {
+			reply = {{"status", "error"}, {"error", e.what()}};
+		}
+		return reply.dump();
+	}
+
+	void loop(zmqpp::context* ctx, std::string endpoint) {
+		zmqpp::socket rep(*ctx, zmqpp::socket_type::reply);
+		rep.set(zmqpp::socket_option::receive_timeout, CONTROL_POLL_MS);
+		rep.set(zmqpp::socket_option::linger, 0);
+		try {
+			rep.bind(endpoint);
+		}
+		catch(std::exception& e) {
+			YELL("\nError: Unable to bind control socket to %s .. Runtime reconfiguration disabled.\n\n", endpoint.c_str());
+			return;
+		}
+		while(!stop_flag.load(std::memory_order_relaxed)) {
+			std::string msg;
+			if(!rep.receive(msg)) continue; // Timeout.
+			rep.send(handle(msg));
+		}
+		rep.close();
+	}
+
+public:
+	void start(zmqpp::context* ctx, int port, const g_config_t& initial) {
+		staged = applied = initial;
+		char endpoint[64];
+		sprintf(endpoint, "tcp://*:%d", port);
+		worker = std::thread(&ControlServer::loop, this, ctx, std::string(endpoint));
+		WARN("Listening for runtime reconfiguration on TCP port: " EMPH(%d) ".\n", port);
+	}
+
+	void stop() {
+		stop_flag = true;
+		if(worker.joinable()) worker.join();
+	}
+	~ControlServer() { stop(); }
+
+	/* Unpacker thread, at BoS: one atomic load unless a change is pending. */
+	inline bool pending() const {
+		return staged_seq.load(std::memory_order_acquire) != applied_seq;
+	}
+
+	void take(g_config_t& dest) {
+		std::lock_guard<std::mutex> lock(mtx);
+		for(const json& req : pending_reqs) dest = parse_set(req, dest); // Validated already, can't throw.
+		pending_reqs.clear();
+		staged = applied = dest;
+		applied_seq = staged_seq.load(std::memory_order_relaxed);
+		applied_seq_shared.store(applied_seq, std::memory_order_relaxed);
+	}
+
+	/* `g_config` was changed by something else (checkpoint restore): rebase the view on it. */
+	void rebase(const g_config_t& c) {
+		std::lock_guard<std::mutex> lock(mtx);
+		staged = applied = c;
+		for(const json& req : pending_reqs) staged = parse_set(req, staged);
+	}
+};
+
+ControlServer control;
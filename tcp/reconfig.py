@@ -0,0 +1,45 @@
+#!/usr/bin/python3
+import sys
+
+usage = f'''Usage: {sys.argv[0]} HOST [PORT] REQUEST ... default port is 8890
+REQUEST is a JSON object, e.g.
+  '{{"nbins_micro": 120}}'
+  '{{"bin_macro": [0.2, null, null, null], "alias": {{"2": "SCI21"}}}}'
+  '{{"publish": {{"json": false}}}}'
+  '{{"cmd": "get"}}'
+Changes are applied by the server at the next BoS.'''
+
+if len(sys.argv) < 3 or '--help' in sys.argv:
+    print(usage)
+    quit()
+
+import zmq
+import json
+
+host = sys.argv[1]
+port = 8890
+request = sys.argv[-1]
+if len(sys.argv) > 3:
+    port = int(sys.argv[2])
+
+try:
+    json.loads(request)
+except json.JSONDecodeError as e:
+    print(f"Request is not valid JSON: {e}")
+    quit(1)
+
+context = zmq.Context()
+socket = context.socket(zmq.REQ)
+socket.setsockopt(zmq.RCVTIMEO, 3000)
+socket.setsockopt(zmq.LINGER, 0)
+socket.connect(f"tcp://{host}:{port}")
+socket.send_string(request)
+try:
+    reply = json.loads(socket.recv_string())
+except zmq.error.Again:
+    print(f"No reply from {host}:{port} .. is the server running with --control?")
+    quit(1)
+
+print(json.dumps(reply, indent=4))
+if reply.get("status") != "ok":
+    quit(1)
@@ -0,0 +1,60 @@
+#pragma once
+/* Unwrapping of the free-running counters (VULOM clock, ECL_IN(x) scalers, the 31-bit hit stamps).
+ * Standalone, part of libmicrospill. Define SCALER_WARN before including to reroute the warnings,
+ * the unpacker sends them through its log ring. */
+
+#include <cstdint>
+#include <cstdio>
+#include "../common.hh"
+
+#ifndef SCALER_WARN
+#define SCALER_WARN WARN
+#endif
+
+/* Container to keep the values and increments in a stable way. Plus error notifications.*/
+template<uint32_t N = 32>
+class Scaler {
+	static_assert(N <= 32, "Template parameter for `Scaler` must be <= 32.");
+	static const uint32_t _mask = static_cast<uint32_t>((1ULL << N) - 1);
+	static const int64_t wrap_point = 1LL << (N - 2);
+public:
+	uint32_t prev_data; 
+	uint32_t curr_data; 
+	Scaler() : prev_data(-1), curr_data(0xeeeeeeee) {} 
+	
+	inline void assign(uint32_t fresh) { 
+		prev_data = curr_data; 
+		curr_data = fresh & _mask; 
+	} 
+	uint32_t calc_increment() const noexcept { 
+		if(curr_data >= prev_data) { 
+			return curr_data - prev_data; 
+		} 
+		/* Possible miscounting! */
+		if(prev_data - curr_data < static_cast<uint32_t>(wrap_point)) {
+			SCALER_WARN("Backwards counting in scaler struct. Prev = %u, curr = %u\n", prev_data, curr_data); 
+			return -1; 
+		} 
+		/* Wrap-around. */
+		return (uint32_t)((1ll << N) + (int64_t)curr_data - (int64_t)prev_data); 
+	}
+	inline bool is_in_init() const {
+		return (prev_data == (uint32_t)(-1)) and (curr_data == 0xeeeeeeee);
+	}
+
+	/* `x` and `y` should be at most one wrap-around different. */
+	static int32_t calc_diff(uint32_t x, uint32_t y) noexcept {
+		x &= _mask; y &= _mask;
+
+		int64_t raw_diff = static_cast<int64_t>(x) - static_cast<int64_t>(y);
+		if(raw_diff > wrap_point) { // `y` is one wrap ahead.
+			return static_cast<int32_t>(raw_diff - (1ll<<N));
+		}
+		else if(raw_diff < -wrap_point) { // `x` is one wrap ahead.
+			return static_cast<int32_t>(raw_diff + (1ll<<N));
+		}
+		else {
+			return static_cast<int32_t>(raw_diff);
+		}
+	}
+};
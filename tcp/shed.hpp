@@ -0,0 +1,115 @@
+/* Load shedding, also #include'd into the main user fnc .cc file.
+ * When the unpacker can't keep up with the readout, ucesb's input backs up and eventually
+ * whole events get dropped. With `--shed[=T]` the processing lag is tracked: the wall time
+ * passed minus the VULOM clock time passed, accumulated over the spill cycles and floored at 0
+ * (replaying a file runs ahead of the clock, and never lags).
+ * At BoS, if the lag is above T and still growing, the budget of histogrammed hits per spill
+ * is halved; once it's below T/4, it's doubled again. The budget is shared out between the
+ * channels by water-filling on their hits of the previous spill, and each channel gets the
+ * prescale reaching its share, but never so high that fewer than SHED_MIN_FILLED of its
+ * hits per spill are histogrammed.
+ * Prescaled: only every k-th hit goes into the microspill histogram (its log10 is the costly
+ * part) and the phase folding (a couple of multiplications per candidate period). At EoS the
+ * microspill counts are scaled back by k; the folding isn't, so its chi^2 keeps its meaning.
+ * Exact, every hit: the unwrapping into `dt` (the ucesb output), the macrospill histogram,
+ * the quality statistics and the bursts. They all need the running time of every hit
+ * anyway, and bin or sum it in a few cycles, so prescaling them would save little. */
+
+#define DEFAULT_SHED_LAG 1.0 // [s]
+#define MAX_PRESCALE 256
+#define SHED_MIN_FILLED 2000 // Hits per channel and spill.
+
+class LoadShedder {
+	uint32_t last_clk = 0;
+	uint64_t data_ticks = 0;  // VULOM clock, unwrapped.
+	bool clock_started = false;
+
+	double last_wall = 0;
+	uint64_t last_ticks = 0;
+	bool cycle_started = false;
+	double prev_lag = 0;
+
+	double fill_budget = INFINITY;  // Histogrammed hits per spill.
+	uint64_t raw_hits[4] = {0};     // Of the previous spill, scaled back.
+public:
+	double lag_budget = 0;  // [s], 0 = off.
+	double lag = 0;         // [s], at the last BoS.
+	uint32_t prescale[4] = {1, 1, 1, 1};
+
+	bool enabled() const { return lag_budget > 0; }
+
+	/* Every event. A clock going back means the DAQ restarted, the time in between is skipped. */
+	inline void observe(uint32_t clk) {
+		uint32_t d = clk - last_clk;
+		last_clk = clk;
+		if(!clock_started) { clock_started = true; return; }
+		if(d & 0x80000000) { cycle_started = false; return; }
+		data_ticks += d;
+	}
+
+	/* At EoS, after the scaling back. */
+	void end_spill(uint32_t ch, uint64_t hits) { raw_hits[ch] = hits; }
+
+	/* At BoS, sets `prescale`. Returns true if it changed. */
+	bool begin_spill() {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		double wall = ts.tv_sec + ts.tv_nsec / 1e9;
+		if(cycle_started) {
+			double d_wall = wall - last_wall;
+			double d_data = (data_ticks - last_ticks) / clock_freq;
+			lag = std::max(lag + d_wall - d_data, 0.0);
+		}
+		last_wall = wall;
+		last_ticks = data_ticks;
+		cycle_started = true;
+
+		uint64_t total = 0, filled = 0;
+		FOR(i,4) {
+			total += raw_hits[i];
+			filled += raw_hits[i] / prescale[i];
+		}
+		if(lag > lag_budget and lag > prev_lag and filled > 0) {
+			fill_budget = std::max(std::min(fill_budget, (double)filled) / 2, 4.0 * SHED_MIN_FILLED);
+		}
+		else if(lag < lag_budget / 4) {
+			fill_budget *= 2;
+			if(fill_budget >= total) fill_budget = INFINITY;
+		}
+		prev_lag = lag;
+
+		/* Water-filling: channels below the fair share keep all their hits,
+		 * the share they leave over goes to the busier ones. */
+		uint32_t p[4] = {1, 1, 1, 1};
+		if(std::isfinite(fill_budget)) {
+			bool capped[4] = {false, false, false, false};
+			double left = fill_budget;
+			uint32_t ncapped = 0;
+			for(bool again = true; again and ncapped < 4;) {
+				again = false;
+				double share = left / (4 - ncapped);
+				FOR(i,4) {
+					if(capped[i] or raw_hits[i] > share) continue;
+					capped[i] = true; ++ncapped;
+					left -= raw_hits[i];
+					again = true;
+				}
+			}
+			double share = (ncapped < 4) ? left / (4 - ncapped) : 0;
+			FOR(i,4) {
+				if(capped[i]) continue;
+				double k = (share >= 1) ? std::ceil(raw_hits[i] / share) : MAX_PRESCALE;
+				double k_max = std::max(1.0, std::floor((double)raw_hits[i] / SHED_MIN_FILLED));
+				p[i] = static_cast<uint32_t>(std::clamp(k, 1.0, std::min(k_max, (double)MAX_PRESCALE)));
+			}
+		}
+		bool changed = false;
+		FOR(i,4) {
+			changed |= (p[i] != prescale[i]);
+			prescale[i] = p[i];
+		}
+		return changed;
+	}
+};
+
+LoadShedder shed;
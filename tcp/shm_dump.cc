@@ -0,0 +1,55 @@
+/* Minimal consumer of the shared-memory spill ring, see `shm_ring.hpp`.
+ * Prints a line per spill and channel. */
+
+#include <cstdio>
+#include <cmath>
+#include <thread>
+#include <chrono>
+#include "../common.hh"
+#include "shm_ring.hpp"
+
+int main(int argc, char** argv) {
+	std::string name = SHM_DEFAULT_NAME;
+	bool rewind = false;
+	for(int i = 1; i < argc; ++i) {
+		std::string a = argv[i];
+		if(a == "--help") {
+			printf("Usage: %s [/NAME] [--rewind] ... default name is " SHM_DEFAULT_NAME "\n"
+			       "  --rewind  also print the spills still in the ring.\n", argv[0]);
+			return 0;
+		}
+		else if(a == "--rewind") rewind = true;
+		else name = a;
+	}
+
+	ShmReader r;
+	while(!r.open(name)) std::this_thread::sleep_for(std::chrono::seconds(1));
+	for(;;) {
+		WARN("Attached to " EMPH(%s) ".\n", name.c_str());
+		if(rewind) r.rewind();
+
+		ShmSpill s;
+		for(;;) {
+			ShmStatus st = r.read(s);
+			if(st == ShmStatus::Ok) {
+				printf(BOLD "Spill %lu" KNRM ", duration %.3f s\n", s.spill_number, s.spill_duration / 1e8);
+				FOR(i,4) {
+					const ShmChannel& c = s.ch[i];
+					printf("  %-12s counted %9u  lost %7u  overflows %7u  offspill %8u  duty %.3f\n",
+						c.name, c.counted, c.lost_hits, c.overflows, c.offspill, c.duty_factor);
+				}
+			}
+			else if(st == ShmStatus::Overrun) {
+				WARN("Fell behind, %lu spills missed so far.\n", r.missed);
+			}
+			else if(r.writer_gone()) break;
+			else std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+		WARN("Writer gone, waiting for it to come back.\n");
+		fflush(stdout);
+		/* Wait for a new segment, the old one stays around. */
+		do std::this_thread::sleep_for(std::chrono::seconds(1));
+		while(!r.open(name) or r.writer_gone());
+		rewind = true;
+	}
+}
@@ -0,0 +1,233 @@
+#pragma once
+/* Shared-memory transport of the spills, for consumers on the same host.
+ * #include'd into the main user fnc .cc file (writer), and standalone by the readers,
+ * it only needs the standard library and POSIX.
+ *
+ * The segment (`--shm[=NAME]`, default /microspill) holds a ring of SHM_SLOTS fixed-layout
+ * spill records, written by the unpacker at EoS. Each slot is guarded by a sequence number:
+ * odd while record n is being written (2n+1), 2n+2 once it is complete. A reader checks it
+ * before and after reading the record, so a record overwritten in between is detected.
+ * The writer never waits for the readers; a reader falling more than SHM_SLOTS spills
+ * behind loses the oldest ones, and is told so.
+ *
+ *   ShmReader r;
+ *   if(!r.open("/microspill")) ...
+ *   ShmSpill s;
+ *   for(;;) {
+ *       switch(r.read(s)) {
+ *           case ShmStatus::Ok: use(s); break;
+ *           case ShmStatus::Overrun: // r.missed spills lost so far, just read on.
+ *               break;
+ *           case ShmStatus::Empty: sleep(...); break;
+ *       }
+ *   }
+ *
+ * `r.view(f)` calls `f(const ShmSpill&)` directly on the shared memory instead of copying,
+ * its result is only to be trusted if `view` returns Ok. */
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_DEFAULT_NAME "/microspill"
+#define SHM_SLOTS 64
+#define SHM_MAGIC 0x4d535348 // "MSSH"
+#define SHM_VERSION 1
+#define SHM_NAME_LEN 32
+#define SHM_MAX_BINS_MICRO 256
+#define SHM_MAX_BINS_MACRO 1001
+
+struct ShmChannel {
+	char name[SHM_NAME_LEN];
+	uint32_t counted;
+	uint32_t lost_hits;
+	uint32_t overflows;
+	uint32_t offspill;
+	uint32_t macro_errors;
+	uint32_t elapsed_time_10ns;
+
+	/* Microspill: bin i holds dt in [10^(i*w), 10^((i+1)*w)) x 10 ns, with w = log10(max_range_micro) / nbins_micro. */
+	uint32_t nbins_micro;
+	uint32_t max_range_micro; // [10 ns]
+	uint32_t micro[SHM_MAX_BINS_MICRO];
+
+	/* Macrospill: bin i holds the hits in [i*bin_macro, (i+1)*bin_macro) s after BoS. */
+	double bin_macro; // [s]
+	uint32_t nbins_macro;
+	uint32_t macro[SHM_MAX_BINS_MACRO];
+
+	/* Spill-quality metrics, NaN when there were too few hits. */
+	double duty_factor;
+	double fano_factor;
+	double cv_dt;
+	double peak_to_mean;
+	double lost_fraction;
+};
+
+struct ShmSpill {
+	uint64_t spill_number;
+	uint64_t timestamp_ns;   // Unix time of EoS.
+	uint64_t bos_wr_ns;      // Whiterabbit time of BoS, 0 without Whiterabbit.
+	int32_t spill_duration;  // [10 ns]
+	ShmChannel ch[4];
+};
+
+struct alignas(64) ShmSlot {
+	std::atomic<uint64_t> seq;
+	ShmSpill spill;
+};
+
+struct ShmSegment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t record_size;
+	std::atomic<uint64_t> published;   // Number of complete records.
+	std::atomic<uint32_t> writer_alive;
+	ShmSlot slots[SHM_SLOTS];
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared-memory ring needs lock-free 64-bit atomics.");
+
+enum class ShmStatus {
+	Ok,
+	Empty,    // Nothing new.
+	Overrun   // The reader fell behind, `missed` got updated. Read on.
+};
+
+class ShmWriter {
+	ShmSegment* seg = nullptr;
+	std::string name;
+	uint64_t n = 0;
+public:
+	/* Creates the segment anew, readers of a previous one see `writer_alive` drop to 0. Sets errno on failure. */
+	bool open(const std::string& _name) {
+		name = _name;
+		shm_unlink(name.c_str());
+		int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+		if(fd < 0) return false;
+		if(ftruncate(fd, sizeof(ShmSegment)) != 0) { ::close(fd); return false; }
+		void* p = mmap(nullptr, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(p == MAP_FAILED) return false;
+		seg = new (p) ShmSegment;
+		seg->magic = SHM_MAGIC;
+		seg->version = SHM_VERSION;
+		seg->nslots = SHM_SLOTS;
+		seg->record_size = sizeof(ShmSpill);
+		for(auto& s : seg->slots) s.seq.store(0, std::memory_order_relaxed);
+		seg->published.store(0, std::memory_order_relaxed);
+		seg->writer_alive.store(1, std::memory_order_release);
+		return true;
+	}
+
+	bool is_open() const { return seg != nullptr; }
+
+	/* Record to fill in place, followed by `commit()`. */
+	ShmSpill& begin() {
+		ShmSlot& s = seg->slots[n % SHM_SLOTS];
+		s.seq.store(2 * n + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		return s.spill;
+	}
+	void commit() {
+		seg->slots[n % SHM_SLOTS].seq.store(2 * n + 2, std::memory_order_release);
+		seg->published.store(++n, std::memory_order_release);
+	}
+
+	/* The segment stays, so the readers can still get the last spills. */
+	void close() {
+		if(!seg) return;
+		seg->writer_alive.store(0, std::memory_order_release);
+		munmap(seg, sizeof(ShmSegment));
+		seg = nullptr;
+	}
+};
+
+class ShmReader {
+	const ShmSegment* seg = nullptr;
+	uint64_t next = 0;
+
+	/* Position of the next record to read; skips over what got overwritten. */
+	ShmStatus locate(const ShmSlot*& slot, uint64_t& seq) {
+		uint64_t published = seg->published.load(std::memory_order_acquire);
+		if(next >= published) return ShmStatus::Empty;
+		if(published - next > SHM_SLOTS - 1) {
+			missed += published - (SHM_SLOTS - 1) - next;
+			next = published - (SHM_SLOTS - 1);
+			return ShmStatus::Overrun;
+		}
+		slot = &seg->slots[next % SHM_SLOTS];
+		seq = slot->seq.load(std::memory_order_acquire);
+		if(seq != 2 * next + 2) { ++missed; ++next; return ShmStatus::Overrun; }
+		return ShmStatus::Ok;
+	}
+	ShmStatus validate(const ShmSlot* slot, uint64_t seq) {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(slot->seq.load(std::memory_order_relaxed) != seq) { ++missed; ++next; return ShmStatus::Overrun; }
+		++next;
+		return ShmStatus::Ok;
+	}
+public:
+	uint64_t missed = 0;
+
+	/* Attaches to the segment, and starts from the next spill published.
+	 * Returns false if it doesn't exist (yet), or has a different layout. */
+	bool open(const std::string& name = SHM_DEFAULT_NAME) {
+		close();
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if(fd < 0) return false;
+		struct stat st;
+		if(fstat(fd, &st) != 0 or (size_t)st.st_size < sizeof(ShmSegment)) { ::close(fd); return false; }
+		void* p = mmap(nullptr, sizeof(ShmSegment), PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(p == MAP_FAILED) return false;
+		seg = static_cast<const ShmSegment*>(p);
+		if(seg->magic != SHM_MAGIC or seg->version != SHM_VERSION or
+		   seg->nslots != SHM_SLOTS or seg->record_size != sizeof(ShmSpill)) {
+			close();
+			return false;
+		}
+		next = seg->published.load(std::memory_order_acquire);
+		return true;
+	}
+
+	void close() {
+		if(seg) munmap(const_cast<ShmSegment*>(seg), sizeof(ShmSegment));
+		seg = nullptr;
+	}
+	~ShmReader() { close(); }
+
+	/* Also start with the spills still in the ring. */
+	void rewind() {
+		uint64_t published = seg->published.load(std::memory_order_acquire);
+		next = (published > SHM_SLOTS - 1) ? published - (SHM_SLOTS - 1) : 0;
+	}
+
+	/* The unpacker exited, or restarted with a new segment: `open` again. */
+	bool writer_gone() const { return seg->writer_alive.load(std::memory_order_acquire) == 0; }
+
+	ShmStatus read(ShmSpill& out) {
+		const ShmSlot* slot;
+		uint64_t seq;
+		ShmStatus st = locate(slot, seq);
+		if(st != ShmStatus::Ok) return st;
+		memcpy(&out, &slot->spill, sizeof(ShmSpill));
+		return validate(slot, seq);
+	}
+
+	template<typename F>
+	ShmStatus view(F&& f) {
+		const ShmSlot* slot;
+		uint64_t seq;
+		ShmStatus st = locate(slot, seq);
+		if(st != ShmStatus::Ok) return st;
+		f(slot->spill);
+		return validate(slot, seq);
+	}
+};
@@ -0,0 +1,213 @@
+/* Long-term trend of the per-spill scalars, also #include'd into the main user fnc .cc file.
+ * Fixed memory: three rings, holding the last TREND_SPILLS spills, the spill-averages
+ * of the last TREND_MINUTES minutes and of the last TREND_HOURS hours.
+ * Fed at EoS by the unpacker thread, queried from the control thread (`{"cmd": "trend"}`),
+ * which returns the series in the finest ring still reaching back to `from`,
+ * downsampled with Largest-Triangle-Three-Buckets to the requested number of points. */
+
+#include <mutex>
+
+#define TREND_SPILLS  4096  // ~ 6 hours of 5 s spills.
+#define TREND_MINUTES 10080 // 1 week.
+#define TREND_HOURS   8760  // 1 year.
+#define TREND_DEFAULT_POINTS 1000
+
+constexpr const char* trend_metrics[] = {"counted", "lost_hits", "overflows", "offspill", "duty_factor"};
+constexpr uint32_t TREND_NMETRICS = LEN(trend_metrics);
+constexpr uint32_t TREND_NVALS = 1 + 4 * TREND_NMETRICS; // `spill_duration`, then per channel.
+
+struct TrendPoint {
+	uint64_t t;   // Unix time of EoS [ns].
+	float v[TREND_NVALS];
+};
+
+/* Sums over the spills of a bucket, NaNs left out per value. Carried up the tiers,
+ * so the coarser averages are per spill, not per finer bucket. */
+struct TrendBucket {
+	uint64_t t;
+	double sum[TREND_NVALS];
+	uint32_t n[TREND_NVALS];
+
+	TrendPoint average() const {
+		TrendPoint p;
+		p.t = t;
+		FOR(i, TREND_NVALS) p.v[i] = n[i] ? sum[i] / n[i] : NAN;
+		return p;
+	}
+};
+
+class TrendTier {
+	std::vector<TrendPoint> ring;
+	uint32_t head = 0;
+	uint32_t count = 0;
+
+	/* Bucket being summed. */
+	uint64_t acc_key = 0;
+	TrendBucket acc;
+	uint32_t acc_parts = 0;
+public:
+	const char* name;
+	uint64_t width; // Bucket width [ns], 0 = one point per spill.
+
+	TrendTier(const char* _name, uint32_t capacity, uint64_t _width) : ring(capacity), name(_name), width(_width) {}
+
+	void push(const TrendPoint& p) {
+		ring[head] = p;
+		head = (head + 1) % ring.size();
+		if(count < ring.size()) ++count;
+	}
+	/* Oldest first. */
+	const TrendPoint& at(uint32_t i) const { return ring[(head + ring.size() - count + i) % ring.size()]; }
+	uint32_t size() const { return count; }
+	bool full() const { return count == ring.size(); }
+
+	/* Adds `b` (a spill, or a bucket of a finer tier) to the running bucket. Returns true
+	 * and the closed bucket in `out` when `b` is the first one past it. */
+	bool accumulate(const TrendBucket& b, TrendBucket& out) {
+		uint64_t key = b.t / width;
+		bool closed = false;
+		if(acc_parts > 0 and key != acc_key) {
+			out = acc;
+			closed = true;
+		}
+		if(acc_parts == 0 or closed) {
+			acc_key = key;
+			acc.t = key * width + width / 2;
+			acc_parts = 0;
+			FOR(i, TREND_NVALS) { acc.sum[i] = 0; acc.n[i] = 0; }
+		}
+		FOR(i, TREND_NVALS) {
+			acc.sum[i] += b.sum[i];
+			acc.n[i] += b.n[i];
+		}
+		++acc_parts;
+		return closed;
+	}
+};
+
+/* Largest-Triangle-Three-Buckets: keeps the first and last point, and from each of the
+ * `n - 2` buckets in between the point spanning the largest triangle with the point kept
+ * from the previous bucket and the average of the next bucket. O(size), returns the indices. */
+std::vector<uint32_t> lttb(const std::vector<double>& x, const std::vector<double>& y, uint32_t n) {
+	uint32_t size = x.size();
+	std::vector<uint32_t> kept;
+	if(n >= size or n < 3) {
+		FOR(i, size) kept.push_back(i);
+		return kept;
+	}
+	kept.reserve(n);
+	kept.push_back(0);
+
+	double every = (double)(size - 2) / (n - 2);
+	uint32_t a = 0;
+	FOR(i, n - 2) {
+		uint32_t next_start = (uint32_t)((i + 1) * every) + 1;
+		uint32_t next_end = std::min((uint32_t)((i + 2) * every) + 1, size);
+		double avg_x = 0, avg_y = 0;
+		for(uint32_t k = next_start; k < next_end; ++k) { avg_x += x[k]; avg_y += y[k]; }
+		avg_x /= (next_end - next_start); avg_y /= (next_end - next_start);
+
+		uint32_t start = (uint32_t)(i * every) + 1;
+		uint32_t end = (uint32_t)((i + 1) * every) + 1;
+		double best = -1;
+		uint32_t best_k = start;
+		for(uint32_t k = start; k < end; ++k) {
+			double area = std::abs((x[a] - avg_x) * (y[k] - y[a]) - (x[a] - x[k]) * (avg_y - y[a]));
+			if(area > best) { best = area; best_k = k; }
+		}
+		kept.push_back(best_k);
+		a = best_k;
+	}
+	kept.push_back(size - 1);
+	return kept;
+}
+
+class TrendStore {
+	std::mutex mtx;
+	TrendTier tiers[3] = {
+		{"spill",  TREND_SPILLS,  0},
+		{"minute", TREND_MINUTES, 60'000'000'000ULL},
+		{"hour",   TREND_HOURS,   3'600'000'000'000ULL}
+	};
+public:
+	/* Unpacker thread, at EoS. */
+	void push(uint64_t t, int32_t spill_duration, const json& jdata, const QualityMetrics (&qm)[4]) {
+		TrendPoint p;
+		p.t = t;
+		p.v[0] = spill_duration;
+		FOR(i,4) {
+			float* v = &p.v[1 + i * TREND_NMETRICS];
+			v[0] = jdata[i]["counted"].get<float>();
+			v[1] = jdata[i]["lost_hits"].get<float>();
+			v[2] = jdata[i]["overflows"].get<float>();
+			v[3] = jdata[i]["offspill"].get<float>();
+			v[4] = qm[i].duty_factor;
+		}
+		TrendBucket b;
+		b.t = t;
+		FOR(i, TREND_NVALS) {
+			bool valid = !std::isnan(p.v[i]);
+			b.sum[i] = valid ? p.v[i] : 0;
+			b.n[i] = valid;
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		tiers[0].push(p);
+		TrendBucket minute, hour;
+		if(tiers[1].accumulate(b, minute)) {
+			tiers[1].push(minute.average());
+			if(tiers[2].accumulate(minute, hour)) tiers[2].push(hour.average());
+		}
+	}
+
+	/* Control thread. Request keys: `metric` (`spill_duration` or one of `trend_metrics`),
+	 * `channel` (1-4), `from`, `until` (Unix time [ns]), `points`. */
+	json query(const json& req) {
+		std::string metric = req.at("metric").get<std::string>();
+		uint32_t index = 0;
+		if(metric != "spill_duration") {
+			uint32_t m = 0;
+			while(m < TREND_NMETRICS and metric != trend_metrics[m]) ++m;
+			if(m == TREND_NMETRICS) throw std::invalid_argument("trend: unknown metric " + metric);
+			int ch = req.value("channel", 1);
+			if(ch < 1 or ch > 4) throw std::out_of_range("trend: channel must be 1-4");
+			index = 1 + (ch - 1) * TREND_NMETRICS + m;
+		}
+		uint64_t from = req.value("from", (uint64_t)0);
+		uint64_t until = req.value("until", UINT64_MAX);
+		uint32_t points = req.value("points", TREND_DEFAULT_POINTS);
+		if(points < 3) throw std::out_of_range("trend: points must be >= 3");
+
+		std::vector<uint64_t> ts;
+		std::vector<double> x, y; // x in seconds from the first point, for the triangle areas.
+		const char* tier_name;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			const TrendTier* tier = &tiers[2];
+			for(const auto& t : tiers) {
+				if(!t.full() or (t.size() and t.at(0).t <= from)) { tier = &t; break; }
+			}
+			tier_name = tier->name;
+			FOR(i, tier->size()) {
+				const TrendPoint& p = tier->at(i);
+				if(p.t < from or p.t >= until or std::isnan(p.v[index])) continue;
+				ts.push_back(p.t);
+				x.push_back((p.t - ts[0]) / 1e9);
+				y.push_back(p.v[index]);
+			}
+		}
+		json reply;
+		reply["tier"] = tier_name;
+		reply["metric"] = metric;
+		std::vector<uint64_t> ot;
+		std::vector<double> oy;
+		for(uint32_t k : lttb(x, y, points)) {
+			ot.push_back(ts[k]);
+			oy.push_back(y[k]);
+		}
+		reply["t"] = std::move(ot);
+		reply["y"] = std::move(oy);
+		return reply;
+	}
+};
+
+TrendStore trend;